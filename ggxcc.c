@@ -8,6 +8,30 @@
 #include <stdint.h>
 #if !defined(_MSC_VER)
 #include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#if defined(__GNUC__) && defined(RYGI__X86_TARGET)
+#define AVX2FUNC __attribute__((__target__("avx2,fma,f16c"), force_align_arg_pointer))
+#elif defined(__GNUC__)
+#define AVX2FUNC __attribute__((__target__("avx2,fma,f16c")))
+#else
+#define AVX2FUNC
+#endif
+
+// AVX-512 intrinsics need VS2017 or newer
+#if !defined(_MSC_VER) || _MSC_VER >= 1910
+#define GGXCC_AVX512
+#endif
+
+#if defined(__GNUC__) && defined(RYGI__X86_TARGET)
+#define AVX512FUNC __attribute__((__target__("avx512f"), force_align_arg_pointer))
+#elif defined(__GNUC__)
+#define AVX512FUNC __attribute__((__target__("avx512f")))
+#else
+#define AVX512FUNC
 #endif
 
 // ***************************************************************************
@@ -43,6 +67,29 @@ int64_t jrcGetTime()
 #endif
 }
 
+// ***************************************************************************
+// CPU feature detection
+
+void getCpuid(unsigned int cpuInfo[4], unsigned int leaf, unsigned int subleaf)
+{
+#if !defined(_MSC_VER)
+	__cpuid_count(leaf, subleaf, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3]);
+#else
+	__cpuidex((int *)cpuInfo, leaf, subleaf);
+#endif
+}
+
+uint64_t getXcr0()
+{
+#if !defined(_MSC_VER)
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#else
+	return _xgetbv(0);
+#endif
+}
+
 // ***************************************************************************
 
 /*
@@ -158,6 +205,80 @@ static float solidAngleTerm(unsigned int x, unsigned int y, float inverseEdgeLen
 
 // ***************************************************************************
 
+// ***************************************************************************
+// Geometry tables
+//
+// The inverse length and solid angle of a texel only depend on resolution,
+// are the same on every face, and are symmetric about the axes and diagonals
+// of a face.  So they're computed for one octant, mirrored to the rest of the
+// face, and kept per resolution for the rest of the run.  Tables are built on
+// first use, main builds all that threads need before starting them.
+
+#define GEOMETRY_TABLES_MAX 32
+
+typedef struct
+{
+	int res;
+	float *invLengths;
+	float *solidAngles;
+}
+geometryTable_t;
+
+geometryTable_t geometryTables[GEOMETRY_TABLES_MAX];
+int numGeometryTables = 0;
+
+const geometryTable_t *getGeometryTable(int res)
+{
+	geometryTable_t *table;
+	int half = (res + 1) / 2;
+	int x, y, i;
+
+	for (i = 0; i < numGeometryTables; i++)
+		if (geometryTables[i].res == res)
+			return &geometryTables[i];
+
+	if (numGeometryTables == GEOMETRY_TABLES_MAX)
+	{
+		printf("Error! Too many geometry tables.\n");
+		exit(1);
+	}
+
+	table = &geometryTables[numGeometryTables++];
+	table->res = res;
+	table->invLengths = malloc(res * res * sizeof(*table->invLengths));
+	table->solidAngles = malloc(res * res * sizeof(*table->solidAngles));
+
+	// octant x <= y of the top left quadrant, rows stored with stride res
+	for (y = 0; y < half; y++)
+	{
+		float v = -1.0f + 1.0f / res + 2.0f * y / res;
+
+		for (x = 0; x <= y; x++)
+		{
+			float u = -1.0f + 1.0f / res + 2.0f * x / res;
+
+			table->invLengths[y * res + x] = 1.0f / sqrt(u * u + v * v + 1.0f);
+			table->solidAngles[y * res + x] = solidAngleTerm(x, y, 1.0f / res);
+		}
+	}
+
+	for (y = 0; y < res; y++)
+	{
+		for (x = 0; x < res; x++)
+		{
+			int a = MIN(x, res - 1 - x), b = MIN(y, res - 1 - y);
+			int octant = MAX(a, b) * res + MIN(a, b);
+
+			table->invLengths[y * res + x] = table->invLengths[octant];
+			table->solidAngles[y * res + x] = table->solidAngles[octant];
+		}
+	}
+
+	return table;
+}
+
+// ***************************************************************************
+
 float convertNativeCoordToTexCoord(int coord, int res, float warp)
 {
 	float tc = (coord + 0.5f) / (float)(res);
@@ -190,7 +311,7 @@ void genNorm(float norm[4], int x, int y, int face, int res, float warp)
 	MapCubeToVec3(norm, st, face);
 	Vec3Normalize(norm);
 
-	norm[3] = solidAngleTerm(x, y, 1.0f / res);
+	norm[3] = getGeometryTable(res)->solidAngles[y * res + x];
 }
 
 float *formatDataForConvolutionScalar(uint8_t *rgba8, int inRes)
@@ -199,20 +320,16 @@ float *formatDataForConvolutionScalar(uint8_t *rgba8, int inRes)
 	unsigned char *inPixel = rgba8;
 	float *outData = malloc(inRes * inRes * 6 * 5 * sizeof(*outData));
 	float *outPixel = outData;
+	const geometryTable_t *table = getGeometryTable(inRes);
 
 	for (face = 0; face < 6; face++)
 	{
 		for (y = 0; y < inRes; y++)
 		{
-			vec2_t v;
-			v[1] = -1.0f + 1.0f / inRes + 2.0f * y / inRes ;
-
 			for (x = 0; x < inRes; x++)
 			{
-				v[0] = -1.0f + 1.0f / inRes + 2.0f * x / inRes ;
-
-				*outPixel++ = 1.0f / sqrt(v[0] * v[0] + v[1] * v[1] + 1.0f);
-				*outPixel++ = solidAngleTerm(x, y, 1.0f / inRes);
+				*outPixel++ = table->invLengths[y * inRes + x];
+				*outPixel++ = table->solidAngles[y * inRes + x];
 				*outPixel++ = ryg_srgb8_to_float(*inPixel++);
 				*outPixel++ = ryg_srgb8_to_float(*inPixel++);
 				*outPixel++ = ryg_srgb8_to_float(*inPixel++);
@@ -224,36 +341,45 @@ float *formatDataForConvolutionScalar(uint8_t *rgba8, int inRes)
 	return outData;
 }
 
-float *formatDataForConvolutionSSE2(uint8_t *rgba8, int inRes)
+// SIMD layout, rows are padded to a whole number of groups.
+// Each group stores the inverse lengths of its texels, followed by their premultiplied RGBA.
+// Padding texels are all zeroes, so they never contribute to a result.
+float *formatDataForConvolutionGrouped(uint8_t *rgba8, int inRes, int groupWidth)
 {
 	int face, y, x;
+	int stride = (inRes + groupWidth - 1) & ~(groupWidth - 1);
 	unsigned char *inPixel = rgba8;
-	float *outData = _mm_malloc(inRes * inRes * 6 * 5 * sizeof(*outData), 16);
+	float *outData = _mm_malloc(stride * inRes * 6 * 5 * sizeof(*outData), groupWidth * sizeof(*outData));
 	float *outPixel = outData;
+	const geometryTable_t *table = getGeometryTable(inRes);
 
 	for (face = 0; face < 6; face++)
 	{
 		for (y = 0; y < inRes; y++)
 		{
-			vec2_t v;
-			v[1] = -1.0f + 1.0f / inRes + 2.0f * y / inRes ;
-
-			for (x = 0; x < inRes; x += 4)
+			for (x = 0; x < stride; x += groupWidth)
 			{
 				int sx;
-				for (sx = 0; sx < 4; sx++)
-				{
-					v[0] = -1.0f + 1.0f / inRes + 2.0f * (x + sx) / inRes ;
-					*outPixel++ = 1.0f / sqrt(v[0] * v[0] + v[1] * v[1] + 1.0f);
-				}
-				for (sx = 0; sx < 4; sx++)
+				for (sx = 0; sx < groupWidth; sx++)
+					*outPixel++ = (x + sx < inRes) ? table->invLengths[y * inRes + x + sx] : 0.0f;
+				for (sx = 0; sx < groupWidth; sx++)
 				{
-					float solidAngle = solidAngleTerm((x + sx), y, 1.0f / inRes);
-					*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
-					*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
-					*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
-					*outPixel++ = solidAngle;
-					inPixel++;
+					if (x + sx < inRes)
+					{
+						float solidAngle = table->solidAngles[y * inRes + x + sx];
+						*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+						*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+						*outPixel++ = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+						*outPixel++ = solidAngle;
+						inPixel++;
+					}
+					else
+					{
+						*outPixel++ = 0.0f;
+						*outPixel++ = 0.0f;
+						*outPixel++ = 0.0f;
+						*outPixel++ = 0.0f;
+					}
 				}
 			}
 		}
@@ -262,198 +388,691 @@ float *formatDataForConvolutionSSE2(uint8_t *rgba8, int inRes)
 	return outData;
 }
 
-float *(*formatDataForConvolution)(uint8_t *, int) = formatDataForConvolutionScalar;
+float *formatDataForConvolutionSSE2(uint8_t *rgba8, int inRes)
+{
+	return formatDataForConvolutionGrouped(rgba8, inRes, 4);
+}
 
-void convolveFaceToVectorScalar(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+float *formatDataForConvolutionAVX2(uint8_t *rgba8, int inRes)
 {
-	float color[3] = {0.0f, 0.0f, 0.0f}, weightAccum = 0.0f;
-	float alpha = roughness * roughness;
-	float aa = alpha * alpha;
-	
-	// constants to speed up ggx calculation in the main loop
-	float c1 = 0.5f * aa - 0.5f;
-	float c2 = c1 + 1.0f;
-	
-	// delta for NL per coordinate increment
-	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
-	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
-	
-	// value of NL at left side of texture, starts from top and incremented to bottom
-	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+	return formatDataForConvolutionGrouped(rgba8, inRes, 8);
+}
 
-	// determine valid Y range
-	// bail out if none
-	float NL = baseNL;
-	if (deltaNL_perX > 0.0f)
-		NL += deltaNL_perX * (width - 1);
+#ifdef GGXCC_AVX512
+float *formatDataForConvolutionAVX512(uint8_t *rgba8, int inRes)
+{
+	return formatDataForConvolutionGrouped(rgba8, inRes, 16);
+}
+#endif
+
+// Planar layout, each face is stored as five planes:
+// inverse length, R * solid angle, G * solid angle, B * solid angle, and solid angle.
+// Planes are 64 byte aligned, and rows are padded to a multiple of 16 texels with zeroes.
+float *formatDataForConvolutionPlanar(uint8_t *rgba8, int inRes)
+{
+	int face, y, x;
+	int stride = (inRes + 15) & ~0x0f;
+	int planeSize = stride * inRes;
+	unsigned char *inPixel = rgba8;
+	float *outData = _mm_malloc(planeSize * 5 * 6 * sizeof(*outData), 64);
+	const geometryTable_t *table = getGeometryTable(inRes);
+
+	memset(outData, 0, planeSize * 5 * 6 * sizeof(*outData));
+
+	for (face = 0; face < 6; face++)
+	{
+		float *outPixel = outData + face * planeSize * 5;
+
+		for (y = 0; y < inRes; y++, outPixel += stride)
+		{
+			for (x = 0; x < inRes; x++)
+			{
+				float solidAngle = table->solidAngles[y * inRes + x];
+
+				outPixel[x]                 = table->invLengths[y * inRes + x];
+				outPixel[x + planeSize]     = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+				outPixel[x + planeSize * 2] = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+				outPixel[x + planeSize * 3] = ryg_srgb8_to_float(*inPixel++) * solidAngle;
+				outPixel[x + planeSize * 4] = solidAngle;
+				inPixel++;
+			}
+		}
+	}
 	
-	int startY = 0, endY = height;
-	if (deltaNL_perY == 0.0f)
+	return outData;
+}
+
+// Converts to half precision, rounding to nearest even.
+uint16_t floatToHalf(float f)
+{
+	uint32_t u = AS_UINT(f);
+	uint32_t sign = (u >> 16) & 0x8000;
+	int exponent = (int)((u >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = u & 0x7fffff;
+
+	if (exponent >= 31)
+		return sign | 0x7c00;
+
+	if (exponent <= 0)
 	{
-		if (NL <= minNL)
-			goto ConvolveFinish;
+		// denormal or zero
+		if (exponent < -10)
+			return sign;
+
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1 << shift) - 1);
+		uint32_t halfway = 1 << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return sign | half;
 	}
-	else if (deltaNL_perY < 0.0f)
+
+	uint32_t half = (exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return sign | half;
+}
+
+float halfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	float f;
+
+	if (exponent == 0)
 	{
-		if (NL <= minNL)
-			goto ConvolveFinish;
-		endY = ceil((NL - minNL) / -deltaNL_perY);
-		if (endY > height)
-			endY = height;
+		// denormal or zero
+		f = mantissa * (1.0f / 16777216.0f);
+		AS_UINT(f) |= sign;
 	}
-	else if (NL <= minNL)
+	else
 	{
-		startY = ceil(-(NL - minNL) / deltaNL_perY);
-		if (startY > height)
-			goto ConvolveFinish;
-		baseNL += deltaNL_perY * startY;
+		uint32_t u = sign | ((exponent == 31 ? 255 : exponent - 15 + 127) << 23) | (mantissa << 13);
+		f = AS_FLOAT(u);
 	}
-	
-	float *base_norm_angle_color = inDataFP32 + ((face * width * height) + (startY * width)) * 5;
-	
-	int leftY = endY - startY;
-	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += width * 5)
+
+	return f;
+}
+
+// Compact planar layout, each face is stored as four half precision planes:
+// R * solid angle, G * solid angle, B * solid angle, and solid angle.
+// The inverse length is recomputed from face coordinates in the kernels.
+// Solid angles are scaled by inRes^2 to keep them well inside the half range,
+// this cancels out when the result is normalized.
+// Planes have rows padded to a multiple of 16 texels with zeroes.
+float *formatDataForConvolutionPlanarFP16(uint8_t *rgba8, int inRes)
+{
+	int face, y, x;
+	int stride = (inRes + 15) & ~0x0f;
+	int planeSize = stride * inRes;
+	unsigned char *inPixel = rgba8;
+	uint16_t *outData = _mm_malloc(planeSize * 4 * 6 * sizeof(*outData), 64);
+	float solidAngleScale = (float)inRes * inRes;
+	float maxError = 0.0f;
+	const geometryTable_t *table = getGeometryTable(inRes);
+
+	memset(outData, 0, planeSize * 4 * 6 * sizeof(*outData));
+
+	for (face = 0; face < 6; face++)
 	{
-		// determine valid X range
-		// skip line if none
-		NL = baseNL;
-		
-		int startX = 0, endX = width;
-		if (deltaNL_perX == 0.0f)
-		{
-			if (NL <= minNL)
-				continue;
-		}
-		else if (deltaNL_perX < 0.0f)
-		{
-			if (NL <= minNL)
-				continue;
-			endX = ceil((NL - minNL) / -deltaNL_perX);
-			if (endX > width)
-				endX = width;
-		}
-		else if (NL <= minNL)
-		{
-			startX = ceil(-(NL - minNL) / deltaNL_perX);
-			if (startX > width)
-				continue;
-			NL += deltaNL_perX * startX;
-		}
-		
-		float *norm_angle_color = base_norm_angle_color + startX * 5;
+		uint16_t *outPixel = outData + face * planeSize * 4;
 
-		int leftX = endX - startX;
-		for (; leftX; leftX--, NL += deltaNL_perX)
+		for (y = 0; y < inRes; y++, outPixel += stride)
 		{
-			// normalize NL using stored inverse length of L
-			float nNL = NL * *norm_angle_color++;
+			for (x = 0; x < inRes; x++)
+			{
+				float values[4];
+				int i;
 
-			// since vN == vE, acos(NH) = 0.5 * acos(NL)
-			// so calculate NH * NH from NL
-			// cos(t)^2 = cos(2t) * 0.5 + 0.5
-			
-			//float NHNH = nNL * 0.5 + 0.5;
-			//float d = NHNH * (aa - 1.0f) + 1.0f;
-			float d = nNL * c1 + c2;
-			float dSpecular = aa / (d * d);
+				values[3] = table->solidAngles[y * inRes + x] * solidAngleScale;
+				values[0] = ryg_srgb8_to_float(*inPixel++) * values[3];
+				values[1] = ryg_srgb8_to_float(*inPixel++) * values[3];
+				values[2] = ryg_srgb8_to_float(*inPixel++) * values[3];
+				inPixel++;
 
-			float weight = *norm_angle_color++ * dSpecular * nNL;
-			
-			color[0] += *norm_angle_color++ * weight;
-			color[1] += *norm_angle_color++ * weight;
-			color[2] += *norm_angle_color++ * weight;
-			
-			weightAccum += weight;
+				for (i = 0; i < 4; i++)
+				{
+					uint16_t half = floatToHalf(values[i]);
+					outPixel[x + planeSize * i] = half;
+
+					if (values[i] > 0.0f)
+						maxError = MAX(maxError, fabs(halfToFloat(half) - values[i]) / values[i]);
+				}
+			}
 		}
 	}
 	
-ConvolveFinish:	
-	outColor[0] = color[0];
-	outColor[1] = color[1];
-	outColor[2] = color[2];
-	*outWeightAccum = weightAccum;
+	printf("FP16 input data, max relative storage error %.4f%%.\n", maxError * 100.0f);
+
+	return (float *)outData;
 }
 
+// Integer planar layout, each face is stored as three planes of linear R, G, and B,
+// as 12 bit fixed point in 16 bit integers.  Neither inverse length nor solid angle
+// is stored, the kernels recompute them from face coordinates.
+// Texels are stored in groups of 16 in the order produced by packing two vectors
+// of 8 dwords to words (0-3, 8-11, 4-7, 12-15), so weights can be packed without
+// a shuffle.
+// Planes have rows padded to a multiple of 16 texels with zeroes.
+#define INT16_COLOR_SCALE 4095.0f
 
-SSE2FUNC void convolveFaceToVectorSSE2(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+static const int int16PackOrder[16] = { 0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15 };
+
+float *formatDataForConvolutionPlanarInt16(uint8_t *rgba8, int inRes)
 {
-	__m128 results_4 = _mm_setzero_ps();
-	float alpha = roughness * roughness;
-	float aa = alpha * alpha;
-	
-	// delta for NL per coordinate increment
-	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
-	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
-	
-	// value of NL at left side of texture, starts from top and incremented to bottom
-	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+	int face, y, x;
+	int stride = (inRes + 15) & ~0x0f;
+	int planeSize = stride * inRes;
+	unsigned char *inPixel = rgba8;
+	int16_t *outData = _mm_malloc(planeSize * 3 * 6 * sizeof(*outData), 64);
+	float maxError = 0.0f;
 
-	// determine valid Y range
-	// bail out if none
-	float NL = baseNL;
-	if (deltaNL_perX > 0.0f)
-		NL += deltaNL_perX * (width - 1);
-	
-	int startY = 0, endY = height;
-	if (deltaNL_perY == 0.0f)
-	{
-		if (NL <= minNL)
-			goto ConvolveFinishSSE2;
-	}
-	else if (deltaNL_perY < 0.0f)
-	{
-		if (NL <= minNL)
-			goto ConvolveFinishSSE2;
-		endY = ceil((NL - minNL) / -deltaNL_perY);
-		if (endY > height)
-			endY = height;
-	}
-	else if (NL <= 0.0f)
+	memset(outData, 0, planeSize * 3 * 6 * sizeof(*outData));
+
+	for (face = 0; face < 6; face++)
 	{
-		startY = ceil(-(NL - minNL) / deltaNL_perY);
-		if (startY > height)
-			goto ConvolveFinishSSE2;
-		baseNL += deltaNL_perY * startY;
+		int16_t *outPixel = outData + face * planeSize * 3;
+
+		for (y = 0; y < inRes; y++, outPixel += stride)
+		{
+			for (x = 0; x < inRes; x++)
+			{
+				int i, outX = (x & ~0x0f) + int16PackOrder[x & 0x0f];
+
+				for (i = 0; i < 3; i++)
+				{
+					float value = ryg_srgb8_to_float(*inPixel++);
+					int16_t fixed = (int16_t)(value * INT16_COLOR_SCALE + 0.5f);
+					outPixel[outX + planeSize * i] = fixed;
+					maxError = MAX(maxError, fabs(fixed / INT16_COLOR_SCALE - value));
+				}
+				inPixel++;
+			}
+		}
 	}
 	
-	float *base_norm_angle_color = inDataFP32 + ((face * width * height) + (startY * width)) * 5;
-	
-	// constants to speed up ggx calculation in the main loop
-	float c1 = 0.5f * aa - 0.5f;
-	float c2 = c1 + 1.0f;
+	printf("INT16 input data, max absolute storage error %.6f.\n", maxError);
 
-	__m128 aa_4 = _mm_set1_ps(aa);
-	__m128 c1_4 = _mm_set1_ps(c1);
-	__m128 c2_4 = _mm_set1_ps(c2);
-	__m128 deltaNL_per4X_4 = _mm_set1_ps(deltaNL_perX * 4.0f);
+	return (float *)outData;
+}
 
-	int leftY = endY - startY;
-	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += width * 5)
+float *(*formatDataForConvolution)(uint8_t *, int) = formatDataForConvolutionScalar;
+
+// ***************************************************************************
+// Source levels
+//
+// A rough lobe covers hundreds of input texels per output pixel, so convolving
+// it from a coarser copy of the input costs little accuracy.  Each output mip
+// uses the coarsest level whose texels are at most sourceLodFraction of its
+// lobe width, measured as the angle between N and half the peak of D.
+//
+// Levels come from the mips in the input file where present, otherwise they
+// are downsampled here, weighting each texel by its solid angle.  Each level
+// is formatted by formatDataForConvolution like the full input.
+
+#define SOURCE_LEVELS_MAX 16
+#define SOURCE_LEVEL_MIN_RES 8
+
+float sourceLodFraction = 0.0f;
+int numSourceLevels = 0;
+float *sourceLevelData[SOURCE_LEVELS_MAX];
+int sourceLevelRes[SOURCE_LEVELS_MAX];
+
+// copy one mip of all faces from the input file, which stores faces with their mips
+uint8_t *extractInputLevel(uint8_t *inData, int inRes, int inNumMips, int level)
+{
+	int face, mip, faceSize = 0, levelOffset = 0;
+	int levelRes = inRes >> level;
+	uint8_t *outData = malloc(levelRes * levelRes * 4 * 6);
+
+	// files may leave the mip count at 0
+	inNumMips = MAX(inNumMips, 1);
+
+	for (mip = 0; mip < inNumMips; mip++)
 	{
-		// determine valid X range
-		// skip line if none
-		NL = baseNL;
-		
-		int startX = 0, endX = width;
-		if (deltaNL_perX == 0.0f)
+		if (mip < level)
+			levelOffset += (inRes >> mip) * (inRes >> mip) * 4;
+		faceSize += MAX(inRes >> mip, 1) * MAX(inRes >> mip, 1) * 4;
+	}
+
+	for (face = 0; face < 6; face++)
+		memcpy(outData + face * levelRes * levelRes * 4, inData + face * faceSize + levelOffset, levelRes * levelRes * 4);
+
+	return outData;
+}
+
+// halve the resolution of all faces, averaging linear colors by solid angle
+uint8_t *downsampleInputLevel(uint8_t *rgba8, int inRes)
+{
+	int face, y, x, i;
+	int outRes = inRes / 2;
+	uint8_t *outData = malloc(outRes * outRes * 4 * 6);
+	uint8_t *outPixel = outData;
+	const geometryTable_t *table = getGeometryTable(inRes);
+
+	for (face = 0; face < 6; face++)
+	{
+		uint8_t *inFace = rgba8 + face * inRes * inRes * 4;
+
+		for (y = 0; y < outRes; y++)
 		{
-			if (NL <= minNL)
-				continue;
+			for (x = 0; x < outRes; x++)
+			{
+				float color[3] = {0.0f, 0.0f, 0.0f}, weightAccum = 0.0f;
+
+				for (i = 0; i < 4; i++)
+				{
+					int inX = x * 2 + (i & 1);
+					int inY = y * 2 + (i >> 1);
+					uint8_t *inPixel = inFace + (inY * inRes + inX) * 4;
+					float solidAngle = table->solidAngles[inY * inRes + inX];
+
+					color[0] += ryg_srgb8_to_float(inPixel[0]) * solidAngle;
+					color[1] += ryg_srgb8_to_float(inPixel[1]) * solidAngle;
+					color[2] += ryg_srgb8_to_float(inPixel[2]) * solidAngle;
+					weightAccum += solidAngle;
+				}
+
+				*outPixel++ = ryg_float_to_srgb8(color[0] / weightAccum);
+				*outPixel++ = ryg_float_to_srgb8(color[1] / weightAccum);
+				*outPixel++ = ryg_float_to_srgb8(color[2] / weightAccum);
+				*outPixel++ = 255;
+			}
 		}
-		else if (deltaNL_perX < 0.0f)
+	}
+
+	return outData;
+}
+
+// format levels below the full input, which is already formatted as inDataFP32
+void buildSourceLevels(uint8_t *inData, int inRes, int inNumMips, float *inDataFP32)
+{
+	uint8_t *levelData = extractInputLevel(inData, inRes, inNumMips, 0);
+	int numFileLevels = 1;
+
+	sourceLevelData[0] = inDataFP32;
+	sourceLevelRes[0] = inRes;
+	numSourceLevels = 1;
+
+	while (numSourceLevels < SOURCE_LEVELS_MAX && (inRes >> numSourceLevels) >= SOURCE_LEVEL_MIN_RES)
+	{
+		uint8_t *nextData;
+
+		if (numSourceLevels < inNumMips)
 		{
-			if (NL <= minNL)
-				continue;
-			endX = ceil((NL - minNL) / -deltaNL_perX);
-			if (endX > width)
-				endX = width;
+			nextData = extractInputLevel(inData, inRes, inNumMips, numSourceLevels);
+			numFileLevels++;
 		}
-		else if (NL <= minNL)
+		else
 		{
-			startX = ceil(-(NL - minNL) / deltaNL_perX);
-			if (startX > width)
-				continue;
+			nextData = downsampleInputLevel(levelData, inRes >> (numSourceLevels - 1));
+		}
+
+		free(levelData);
+		levelData = nextData;
+
+		sourceLevelRes[numSourceLevels] = inRes >> numSourceLevels;
+		sourceLevelData[numSourceLevels] = formatDataForConvolution(levelData, sourceLevelRes[numSourceLevels]);
+		numSourceLevels++;
+	}
+
+	free(levelData);
+
+	printf("Using %d input levels, %d from the input file.\n", numSourceLevels, numFileLevels);
+}
+
+// angle between N and half the peak of D, capped at 90 degrees
+float calcLobeWidth(float roughness)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+
+	// D(NH) is half its peak at NH^2 = (1 - sqrt(2) * aa) / (1 - aa), and L is twice as far from N as H
+	float lobeWidth = 1.5707963f;
+	if (aa < 0.7071068f)
+		lobeWidth = MIN(2.0f * acosf(sqrtf((1.0f - 1.4142136f * aa) / (1.0f - aa))), lobeWidth);
+
+	return lobeWidth;
+}
+
+// pick the input level to convolve a lobe of this roughness from
+int calcSourceLevel(float roughness)
+{
+	int level = 0;
+
+	if (!numSourceLevels)
+		return -1;
+
+	float lobeWidth = calcLobeWidth(roughness);
+
+	// texels at the center of a face span 2 / res radians
+	while (level + 1 < numSourceLevels && 2.0f / sourceLevelRes[level + 1] <= sourceLodFraction * lobeWidth)
+		level++;
+
+	return level;
+}
+
+void selectSourceLevel(float roughness, float **inDataFP32, int *width, int *height)
+{
+	int level = calcSourceLevel(roughness);
+
+	if (level < 0)
+		return;
+
+	*inDataFP32 = sourceLevelData[level];
+	*width = *height = sourceLevelRes[level];
+}
+
+// ***************************************************************************
+// Span helpers
+//
+// Plane culling keeps texels with unnormalized NL > minNL, which on a face is
+// a half plane.  Since inverse length is <= 1 this is a superset of the lobe,
+// and keeps most of the tail on the face the vector points at.
+//
+// Conic culling keeps exactly the texels with nNL > minNL, which on a face lie
+// inside a conic section.  With P = (u, v, 1) and vN = (a, b, c) in face
+// space, for a row v this is f(u) = a * u + (b * v + c) - minNL * |P| > 0, and
+// since f is concave the solution is a single interval of u.  Its ends are the
+// roots of the squared equation on which a * u + b * v + c > 0.
+//
+// These helpers are inlined into the AVX kernels, calling out to non-VEX code
+// from there costs a state transition on every row.
+
+int conicCulling = 0;
+
+// rows of the input faces visible to the kernels, the cache-blocked schedule
+// narrows this to one chunk at a time
+SCHED_THREAD_LOCAL int rowWindowBegin = 0;
+SCHED_THREAD_LOCAL int rowWindowEnd = 0x7fffffff;
+
+// determine valid X range for a vector on one row, for plane culling
+// returns 0 if none
+static inline int calcValidColumnsPlane(float NL, float deltaNL_perX, int width, float minNL, int *outStartX, int *outEndX)
+{
+	int startX = 0, endX = width;
+	if (deltaNL_perX == 0.0f)
+	{
+		if (NL <= minNL)
+			return 0;
+	}
+	else if (deltaNL_perX < 0.0f)
+	{
+		if (NL <= minNL)
+			return 0;
+		endX = ceil((NL - minNL) / -deltaNL_perX);
+		if (endX > width)
+			endX = width;
+	}
+	else if (NL <= minNL)
+	{
+		startX = ceil(-(NL - minNL) / deltaNL_perX);
+		if (startX >= width)
+			return 0;
+	}
+
+	*outStartX = startX;
+	*outEndX = endX;
+	return endX > startX;
+}
+
+// determine valid X range for a vector on row y
+// returns 0 if none
+static inline int calcValidColumns(float vN_vE_FaceSpace[3], int y, int width, int height, float minNL, int *outStartX, int *outEndX)
+{
+	if (!conicCulling)
+	{
+		float NL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y + 1.0f) / height) + vN_vE_FaceSpace[2];
+		return calcValidColumnsPlane(NL, vN_vE_FaceSpace[0] * 2.0f / width, width, minNL, outStartX, outEndX);
+	}
+
+	float a = vN_vE_FaceSpace[0];
+	float v = -1.0f + (2.0f * y + 1.0f) / height;
+	float k = vN_vE_FaceSpace[1] * v + vN_vE_FaceSpace[2];
+	float mm = minNL * minNL;
+	float q = v * v + 1.0f;
+
+	// (a * u + k)^2 - minNL^2 * (u^2 + q) = A * u^2 + 2 * B * u + C
+	float A = a * a - mm;
+	float B = a * k;
+	float C = k * k - mm * q;
+	float roots[2];
+	int numRoots = 0;
+
+	// B * B - A * C, simplified
+	float disc = mm * (k * k + A * q);
+	if (disc >= 0.0f)
+	{
+		// stable form, A may be 0
+		float t = -(B + (B < 0.0f ? -sqrtf(disc) : sqrtf(disc)));
+		if (A != 0.0f && a * (t / A) + k > 0.0f)
+			roots[numRoots++] = t / A;
+		if (t != 0.0f && a * (C / t) + k > 0.0f)
+			roots[numRoots++] = C / t;
+	}
+
+	// interval of u, texel centers are always within (-2, 2)
+	float lo = -2.0f, hi = 2.0f;
+	if (minNL <= 0.0f)
+	{
+		// the conic degenerates to the line a * u + k = 0
+		if (a > 0.0f)
+			lo = -k / a;
+		else if (a < 0.0f)
+			hi = -k / a;
+		else if (k <= 0.0f)
+			return 0;
+	}
+	else if (numRoots == 2)
+	{
+		lo = MIN(roots[0], roots[1]);
+		hi = MAX(roots[0], roots[1]);
+	}
+	else if (numRoots == 1)
+	{
+		// f increases through the root if the valid side is to the right
+		float r = roots[0];
+		if (a - minNL * r / sqrtf(r * r + q) > 0.0f)
+			lo = r;
+		else
+			hi = r;
+	}
+	else if (k <= minNL * sqrtf(q))
+	{
+		// f doesn't cross zero, and is negative at u = 0
+		return 0;
+	}
+
+	lo = CLAMP(lo, -2.0f, 2.0f);
+	hi = CLAMP(hi, -2.0f, 2.0f);
+
+	// texel x has its center at u = (2 * x + 1) / width - 1
+	int startX = (int)floorf(((lo + 1.0f) * width - 1.0f) * 0.5f) + 1;
+	int endX = (int)ceilf(((hi + 1.0f) * width - 1.0f) * 0.5f);
+
+	startX = MAX(startX, 0);
+	endX = MIN(endX, width);
+
+	*outStartX = startX;
+	*outEndX = endX;
+	return endX > startX;
+}
+
+// determine valid Y range for a vector
+// returns 0 if none
+static inline int calcValidRows(float vN_vE_FaceSpace[3], int width, int height, float minNL, int *outStartY, int *outEndY)
+{
+	int startX, endX;
+
+	// rows for plane culling, which also bound the rows for conic culling
+	// since inverse length is <= 1, nNL > minNL implies NL > minNL
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	float NL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+	if (deltaNL_perX > 0.0f)
+		NL += deltaNL_perX * (width - 1);
+	
+	int startY = 0, endY = height;
+	if (deltaNL_perY == 0.0f)
+	{
+		if (NL <= minNL)
+			return 0;
+	}
+	else if (deltaNL_perY < 0.0f)
+	{
+		if (NL <= minNL)
+			return 0;
+		endY = ceil((NL - minNL) / -deltaNL_perY);
+		if (endY > height)
+			endY = height;
+	}
+	else if (NL <= minNL)
+	{
+		startY = ceil(-(NL - minNL) / deltaNL_perY);
+		if (startY >= height)
+			return 0;
+	}
+
+	startY = MAX(startY, rowWindowBegin);
+	endY = MIN(endY, rowWindowEnd);
+
+	// then trim rows the conic misses
+	while (conicCulling && startY < endY && !calcValidColumns(vN_vE_FaceSpace, startY, width, height, minNL, &startX, &endX))
+		startY++;
+	while (conicCulling && endY > startY && !calcValidColumns(vN_vE_FaceSpace, endY - 1, width, height, minNL, &startX, &endX))
+		endY--;
+
+	*outStartY = startY;
+	*outEndY = endY;
+	return endY > startY;
+}
+
+void convolveFaceToVectorScalar(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	float color[3] = {0.0f, 0.0f, 0.0f}, weightAccum = 0.0f;
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinish;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	float *base_norm_angle_color = inDataFP32 + ((face * width * height) + (startY * width)) * 5;
+	
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += width * 5)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL + deltaNL_perX * startX;
+		
+		float *norm_angle_color = base_norm_angle_color + startX * 5;
+
+		int leftX = endX - startX;
+		for (; leftX; leftX--, NL += deltaNL_perX)
+		{
+			// normalize NL using stored inverse length of L
+			float nNL = NL * *norm_angle_color++;
+
+			// since vN == vE, acos(NH) = 0.5 * acos(NL)
+			// so calculate NH * NH from NL
+			// cos(t)^2 = cos(2t) * 0.5 + 0.5
+			
+			//float NHNH = nNL * 0.5 + 0.5;
+			//float d = NHNH * (aa - 1.0f) + 1.0f;
+			float d = nNL * c1 + c2;
+			float dSpecular = aa / (d * d);
+
+			float weight = *norm_angle_color++ * dSpecular * nNL;
+			
+			color[0] += *norm_angle_color++ * weight;
+			color[1] += *norm_angle_color++ * weight;
+			color[2] += *norm_angle_color++ * weight;
+			
+			weightAccum += weight;
 		}
+	}
+	
+ConvolveFinish:	
+	outColor[0] = color[0];
+	outColor[1] = color[1];
+	outColor[2] = color[2];
+	*outWeightAccum = weightAccum;
+}
+
+
+SSE2FUNC void convolveFaceToVectorSSE2(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m128 results_4 = _mm_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishSSE2;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	// rows are padded to a multiple of 4 texels
+	int stride = (width + 3) & ~0x03;
+	float *base_norm_angle_color = inDataFP32 + ((face * stride * height) + (startY * stride)) * 5;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m128 aa_4 = _mm_set1_ps(aa);
+	__m128 c1_4 = _mm_set1_ps(c1);
+	__m128 c2_4 = _mm_set1_ps(c2);
+	__m128 minNL_4 = _mm_set1_ps(minNL);
+	int conic = conicCulling;
+	__m128 two_4 = _mm_set1_ps(2.0f);
+	__m128 deltaNL_per4X_4 = _mm_set1_ps(deltaNL_perX * 4.0f);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += stride * 5)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
 		
 		startX = startX & ~0x03;
 		endX = (endX + 3) & ~0x03;
@@ -473,12 +1092,15 @@ SSE2FUNC void convolveFaceToVectorSSE2(float outColor[3], float *outWeightAccum,
 			__m128 rgba3_4 = _mm_load_ps(norm_angle_color + 16);
 			
 			__m128 nNL_4 = _mm_mul_ps(NL_4, norm_4);
-			nNL_4 = _mm_max_ps(nNL_4, _mm_setzero_ps());
+			nNL_4 = _mm_and_ps(nNL_4, _mm_cmpgt_ps(conic ? nNL_4 : NL_4, minNL_4));
 		
+			// aa / (d * d), using a refined reciprocal instead of a divide
 			__m128 ggx_4 = _mm_mul_ps(nNL_4, c1_4);
 			ggx_4 = _mm_add_ps(ggx_4, c2_4);
 			ggx_4 = _mm_mul_ps(ggx_4, ggx_4);
-			ggx_4 = _mm_div_ps(aa_4, ggx_4);
+			__m128 rcp_4 = _mm_rcp_ps(ggx_4);
+			rcp_4 = _mm_mul_ps(rcp_4, _mm_sub_ps(two_4, _mm_mul_ps(ggx_4, rcp_4)));
+			ggx_4 = _mm_mul_ps(aa_4, rcp_4);
 			
 			__m128 weight_4 = _mm_mul_ps(nNL_4, ggx_4);
 			
@@ -508,92 +1130,4964 @@ ConvolveFinishSSE2:
 	*outWeightAccum = AS_FLOAT(GET_128(results_4).m128_u32[3]);
 }
 
-void (*convolveFaceToVector)(float[3], float *, float *, float *, int, int, int, float, float) = convolveFaceToVectorScalar;
-
-void convolveCubemapToPixel(uint8_t *outData, int outRes, int outNumMips, int outPixelCount, float *inDataFP32, int width, int height, int simSamples)
+AVX2FUNC void convolveFaceToVectorAVX2(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
 {
-	int outMipRes;
-	uint8_t *outPixel = outData + outPixelCount * 4;
-	float color[3] = {0.0f, 0.0f, 0.0f};
-	float vN_vE[4];
+	__m256 results01_8 = _mm256_setzero_ps();
+	__m256 results23_8 = _mm256_setzero_ps();
+	__m256 results45_8 = _mm256_setzero_ps();
+	__m256 results67_8 = _mm256_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
 	
-	// determine outFace, outY, outX
-	outMipRes = outRes;
-	int outNumFacePixels = 0;
-	while(outMipRes)
-	{
-		outNumFacePixels += outMipRes * outMipRes;
-		outMipRes >>= 1;
-	}
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
 	
-	int outFace = outPixelCount / outNumFacePixels;
-	outPixelCount -= outFace * outNumFacePixels;
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
 
-	outMipRes = outRes;
-	int outMipNum = 0;
-	while (outPixelCount >= outMipRes * outMipRes)
-	{
-		outPixelCount -= outMipRes * outMipRes;
-		outMipRes >>= 1;
-		outMipNum++;
-	}
-	
-	int outY = outPixelCount / outMipRes;
-	outPixelCount -= outY * outMipRes;
-	int outX = outPixelCount;
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
 	
-	// first mip is min roughness
-	// last three mips are roughness 1 (~diffuse)
-	// only 4x4 (third last mip) should be used in engine
-	float roughness = outMipNum / (float)(outNumMips - 3);
-	float minRoughness = 0.5f / (float)(outNumMips - 3);
-	roughness = CLAMP(roughness, minRoughness, 1.0f);
+	// rows are padded to a multiple of 8 texels
+	int stride = (width + 7) & ~0x07;
+	float *base_norm_angle_color = inDataFP32 + ((face * stride * height) + (startY * stride)) * 5;
 	
-	float outWarp = calcWarp(outMipRes);
-
-	genNorm(vN_vE, outX, outY, outFace, outMipRes, outWarp);
-
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 deltaNL_perX_8 = _mm256_set1_ps(deltaNL_perX);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	// lane patterns to broadcast the weights of two texels into one register
+	__m256i weight01_idx = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+	__m256i weight23_idx = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+	__m256i weight45_idx = _mm256_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5);
+	__m256i weight67_idx = _mm256_setr_epi32(6, 6, 6, 6, 7, 7, 7, 7);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += stride * 5)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+		
+		startX = startX & ~0x07;
+		endX = (endX + 7) & ~0x07;
+
+		NL += deltaNL_perX * startX;
+		float *norm_angle_color = base_norm_angle_color + startX * 5;
+		
+		__m256 NL_8 = _mm256_fmadd_ps(laneX_8, deltaNL_perX_8, _mm256_set1_ps(NL));
+
+		int leftX8 = (endX - startX) / 8;
+		for (; leftX8; leftX8--, norm_angle_color += 40)
+		{
+			__m256 norm_8    = _mm256_load_ps(norm_angle_color);
+			__m256 rgba01_8  = _mm256_load_ps(norm_angle_color + 8);
+			__m256 rgba23_8  = _mm256_load_ps(norm_angle_color + 16);
+			__m256 rgba45_8  = _mm256_load_ps(norm_angle_color + 24);
+			__m256 rgba67_8  = _mm256_load_ps(norm_angle_color + 32);
+			
+			__m256 nNL_8 = _mm256_mul_ps(NL_8, norm_8);
+			nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8, minNL_8, _CMP_GT_OQ));
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+			ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+			__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+			rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+			ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+			
+			__m256 weight_8 = _mm256_mul_ps(nNL_8, ggx_8);
+			
+			results01_8 = _mm256_fmadd_ps(rgba01_8, _mm256_permutevar8x32_ps(weight_8, weight01_idx), results01_8);
+			results23_8 = _mm256_fmadd_ps(rgba23_8, _mm256_permutevar8x32_ps(weight_8, weight23_idx), results23_8);
+			results45_8 = _mm256_fmadd_ps(rgba45_8, _mm256_permutevar8x32_ps(weight_8, weight45_idx), results45_8);
+			results67_8 = _mm256_fmadd_ps(rgba67_8, _mm256_permutevar8x32_ps(weight_8, weight67_idx), results67_8);
+
+			NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8);
+		}
+	}
+	
+ConvolveFinishAVX2:
+	{
+		__m256 results_8 = _mm256_add_ps(_mm256_add_ps(results01_8, results23_8), _mm256_add_ps(results45_8, results67_8));
+		__m128 results_4 = _mm_add_ps(_mm256_castps256_ps128(results_8), _mm256_extractf128_ps(results_8, 1));
+		ALIGN16 float results[4];
+
+		_mm_store_ps(results, results_4);
+		outColor[0] = results[0];
+		outColor[1] = results[1];
+		outColor[2] = results[2];
+		*outWeightAccum = results[3];
+	}
+}
+
+#ifdef GGXCC_AVX512
+AVX512FUNC void convolveFaceToVectorAVX512(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m512 results0123_16 = _mm512_setzero_ps();
+	__m512 results4567_16 = _mm512_setzero_ps();
+	__m512 results89AB_16 = _mm512_setzero_ps();
+	__m512 resultsCDEF_16 = _mm512_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX512;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	// rows are padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	float *base_norm_angle_color = inDataFP32 + ((face * stride * height) + (startY * stride)) * 5;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m512 aa_16 = _mm512_set1_ps(aa);
+	__m512 c1_16 = _mm512_set1_ps(c1);
+	__m512 c2_16 = _mm512_set1_ps(c2);
+	__m512 two_16 = _mm512_set1_ps(2.0f);
+	__m512 deltaNL_perX_16 = _mm512_set1_ps(deltaNL_perX);
+	__m512 deltaNL_per16X_16 = _mm512_set1_ps(deltaNL_perX * 16.0f);
+	__m512 laneX_16 = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	// lane patterns to broadcast the weights of four texels into one register
+	__m512i weight0123_idx = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+	__m512i weight4567_idx = _mm512_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+	__m512i weight89AB_idx = _mm512_setr_epi32(8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11);
+	__m512i weightCDEF_idx = _mm512_setr_epi32(12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, base_norm_angle_color += stride * 5)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+		
+		if (endX <= startX)
+			continue;
+
+		// mask off the texels outside of [startX, endX) in the first and last groups
+		__mmask16 mask = (__mmask16)(0xffff << (startX & 0x0f));
+		__mmask16 lastMask = (__mmask16)(0xffff >> (15 - ((endX - 1) & 0x0f)));
+
+		int groupX = startX & ~0x0f;
+		NL += deltaNL_perX * groupX;
+		float *norm_angle_color = base_norm_angle_color + groupX * 5;
+		
+		__m512 NL_16 = _mm512_fmadd_ps(laneX_16, deltaNL_perX_16, _mm512_set1_ps(NL));
+
+		int leftX16 = ((endX + 15) >> 4) - (groupX >> 4);
+		for (; leftX16; leftX16--, norm_angle_color += 80, mask = 0xffff)
+		{
+			if (leftX16 == 1)
+				mask &= lastMask;
+
+			__m512 norm_16     = _mm512_load_ps(norm_angle_color);
+			__m512 rgba0123_16 = _mm512_load_ps(norm_angle_color + 16);
+			__m512 rgba4567_16 = _mm512_load_ps(norm_angle_color + 32);
+			__m512 rgba89AB_16 = _mm512_load_ps(norm_angle_color + 48);
+			__m512 rgbaCDEF_16 = _mm512_load_ps(norm_angle_color + 64);
+			
+			// masked off texels get nNL = 0, and so weight = 0
+			__m512 nNL_16 = _mm512_maskz_mul_ps(mask, NL_16, norm_16);
+			nNL_16 = _mm512_max_ps(nNL_16, _mm512_setzero_ps());
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m512 ggx_16 = _mm512_fmadd_ps(nNL_16, c1_16, c2_16);
+			ggx_16 = _mm512_mul_ps(ggx_16, ggx_16);
+			__m512 rcp_16 = _mm512_rcp14_ps(ggx_16);
+			rcp_16 = _mm512_mul_ps(rcp_16, _mm512_fnmadd_ps(ggx_16, rcp_16, two_16));
+			ggx_16 = _mm512_mul_ps(aa_16, rcp_16);
+			
+			__m512 weight_16 = _mm512_mul_ps(nNL_16, ggx_16);
+			
+			results0123_16 = _mm512_fmadd_ps(rgba0123_16, _mm512_permutexvar_ps(weight0123_idx, weight_16), results0123_16);
+			results4567_16 = _mm512_fmadd_ps(rgba4567_16, _mm512_permutexvar_ps(weight4567_idx, weight_16), results4567_16);
+			results89AB_16 = _mm512_fmadd_ps(rgba89AB_16, _mm512_permutexvar_ps(weight89AB_idx, weight_16), results89AB_16);
+			resultsCDEF_16 = _mm512_fmadd_ps(rgbaCDEF_16, _mm512_permutexvar_ps(weightCDEF_idx, weight_16), resultsCDEF_16);
+
+			NL_16 = _mm512_add_ps(NL_16, deltaNL_per16X_16);
+		}
+	}
+	
+ConvolveFinishAVX512:
+	{
+		__m512 results_16 = _mm512_add_ps(_mm512_add_ps(results0123_16, results4567_16), _mm512_add_ps(results89AB_16, resultsCDEF_16));
+		__m128 results_4 = _mm_add_ps(_mm_add_ps(_mm512_castps512_ps128(results_16), _mm512_extractf32x4_ps(results_16, 1)),
+		                              _mm_add_ps(_mm512_extractf32x4_ps(results_16, 2), _mm512_extractf32x4_ps(results_16, 3)));
+		ALIGN16 float results[4];
+
+		_mm_store_ps(results, results_4);
+		outColor[0] = results[0];
+		outColor[1] = results[1];
+		outColor[2] = results[2];
+		*outWeightAccum = results[3];
+	}
+}
+#endif
+
+SSE2FUNC void convolveFaceToVectorSSE2Planar(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m128 red_4 = _mm_setzero_ps();
+	__m128 green_4 = _mm_setzero_ps();
+	__m128 blue_4 = _mm_setzero_ps();
+	__m128 weightAccum_4 = _mm_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishSSE2Planar;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m128 aa_4 = _mm_set1_ps(aa);
+	__m128 c1_4 = _mm_set1_ps(c1);
+	__m128 c2_4 = _mm_set1_ps(c2);
+	__m128 minNL_4 = _mm_set1_ps(minNL);
+	int conic = conicCulling;
+	__m128 two_4 = _mm_set1_ps(2.0f);
+	__m128 deltaNL_per4X_4 = _mm_set1_ps(deltaNL_perX * 4.0f);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, norm += stride)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+		
+		startX = startX & ~0x03;
+		endX = (endX + 3) & ~0x03;
+
+		NL += deltaNL_perX * startX;
+		
+		__m128 NL_4 = _mm_setr_ps(NL, NL + deltaNL_perX, NL + 2.0f * deltaNL_perX, NL + 3.0f * deltaNL_perX);
+
+		int x;
+		for (x = startX; x < endX; x += 4)
+		{
+			__m128 norm_4 = _mm_load_ps(norm + x);
+			
+			__m128 nNL_4 = _mm_mul_ps(NL_4, norm_4);
+			nNL_4 = _mm_and_ps(nNL_4, _mm_cmpgt_ps(conic ? nNL_4 : NL_4, minNL_4));
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m128 ggx_4 = _mm_mul_ps(nNL_4, c1_4);
+			ggx_4 = _mm_add_ps(ggx_4, c2_4);
+			ggx_4 = _mm_mul_ps(ggx_4, ggx_4);
+			__m128 rcp_4 = _mm_rcp_ps(ggx_4);
+			rcp_4 = _mm_mul_ps(rcp_4, _mm_sub_ps(two_4, _mm_mul_ps(ggx_4, rcp_4)));
+			ggx_4 = _mm_mul_ps(aa_4, rcp_4);
+			
+			__m128 weight_4 = _mm_mul_ps(nNL_4, ggx_4);
+
+			red_4         = _mm_add_ps(red_4,         _mm_mul_ps(_mm_load_ps(norm + x + planeSize),     weight_4));
+			green_4       = _mm_add_ps(green_4,       _mm_mul_ps(_mm_load_ps(norm + x + planeSize * 2), weight_4));
+			blue_4        = _mm_add_ps(blue_4,        _mm_mul_ps(_mm_load_ps(norm + x + planeSize * 3), weight_4));
+			weightAccum_4 = _mm_add_ps(weightAccum_4, _mm_mul_ps(_mm_load_ps(norm + x + planeSize * 4), weight_4));
+
+			NL_4 = _mm_add_ps(NL_4, deltaNL_per4X_4);
+		}
+	}
+	
+ConvolveFinishSSE2Planar:
+	{
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		__m128 results_4 = _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4));
+
+		outColor[0] = AS_FLOAT(GET_128(results_4).m128_u32[0]);
+		outColor[1] = AS_FLOAT(GET_128(results_4).m128_u32[1]);
+		outColor[2] = AS_FLOAT(GET_128(results_4).m128_u32[2]);
+		*outWeightAccum = AS_FLOAT(GET_128(results_4).m128_u32[3]);
+	}
+}
+
+AVX2FUNC void convolveFaceToVectorAVX2Planar(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 red_8 = _mm256_setzero_ps();
+	__m256 green_8 = _mm256_setzero_ps();
+	__m256 blue_8 = _mm256_setzero_ps();
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2Planar;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 deltaNL_perX_8 = _mm256_set1_ps(deltaNL_perX);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, norm += stride)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+		
+		startX = startX & ~0x07;
+		endX = (endX + 7) & ~0x07;
+
+		NL += deltaNL_perX * startX;
+		
+		__m256 NL_8 = _mm256_fmadd_ps(laneX_8, deltaNL_perX_8, _mm256_set1_ps(NL));
+
+		int x;
+		for (x = startX; x < endX; x += 8)
+		{
+			__m256 norm_8 = _mm256_load_ps(norm + x);
+			
+			__m256 nNL_8 = _mm256_mul_ps(NL_8, norm_8);
+			nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8, minNL_8, _CMP_GT_OQ));
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+			ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+			__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+			rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+			ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+			
+			__m256 weight_8 = _mm256_mul_ps(nNL_8, ggx_8);
+
+			red_8         = _mm256_fmadd_ps(_mm256_load_ps(norm + x + planeSize),     weight_8, red_8);
+			green_8       = _mm256_fmadd_ps(_mm256_load_ps(norm + x + planeSize * 2), weight_8, green_8);
+			blue_8        = _mm256_fmadd_ps(_mm256_load_ps(norm + x + planeSize * 3), weight_8, blue_8);
+			weightAccum_8 = _mm256_fmadd_ps(_mm256_load_ps(norm + x + planeSize * 4), weight_8, weightAccum_8);
+
+			NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8);
+		}
+	}
+	
+ConvolveFinishAVX2Planar:
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8),         _mm256_extractf128_ps(red_8, 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8),       _mm256_extractf128_ps(green_8, 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8),        _mm256_extractf128_ps(blue_8, 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8), _mm256_extractf128_ps(weightAccum_8, 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+		outColor[0] = results[0];
+		outColor[1] = results[1];
+		outColor[2] = results[2];
+		*outWeightAccum = results[3];
+	}
+}
+
+#ifdef GGXCC_AVX512
+AVX512FUNC void convolveFaceToVectorAVX512Planar(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m512 red_16 = _mm512_setzero_ps();
+	__m512 green_16 = _mm512_setzero_ps();
+	__m512 blue_16 = _mm512_setzero_ps();
+	__m512 weightAccum_16 = _mm512_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX512Planar;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m512 aa_16 = _mm512_set1_ps(aa);
+	__m512 c1_16 = _mm512_set1_ps(c1);
+	__m512 c2_16 = _mm512_set1_ps(c2);
+	__m512 two_16 = _mm512_set1_ps(2.0f);
+	__m512 deltaNL_perX_16 = _mm512_set1_ps(deltaNL_perX);
+	__m512 deltaNL_per16X_16 = _mm512_set1_ps(deltaNL_perX * 16.0f);
+	__m512 laneX_16 = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, norm += stride)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+		
+		if (endX <= startX)
+			continue;
+
+		// mask off the texels outside of [startX, endX) in the first and last vectors
+		__mmask16 mask = (__mmask16)(0xffff << (startX & 0x0f));
+		__mmask16 lastMask = (__mmask16)(0xffff >> (15 - ((endX - 1) & 0x0f)));
+
+		int x = startX & ~0x0f;
+		NL += deltaNL_perX * x;
+		
+		__m512 NL_16 = _mm512_fmadd_ps(laneX_16, deltaNL_perX_16, _mm512_set1_ps(NL));
+
+		for (; x < endX; x += 16, mask = 0xffff)
+		{
+			if (x + 16 >= endX)
+				mask &= lastMask;
+
+			// masked off texels get nNL = 0, and so weight = 0
+			__m512 nNL_16 = _mm512_maskz_mul_ps(mask, NL_16, _mm512_load_ps(norm + x));
+			nNL_16 = _mm512_max_ps(nNL_16, _mm512_setzero_ps());
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m512 ggx_16 = _mm512_fmadd_ps(nNL_16, c1_16, c2_16);
+			ggx_16 = _mm512_mul_ps(ggx_16, ggx_16);
+			__m512 rcp_16 = _mm512_rcp14_ps(ggx_16);
+			rcp_16 = _mm512_mul_ps(rcp_16, _mm512_fnmadd_ps(ggx_16, rcp_16, two_16));
+			ggx_16 = _mm512_mul_ps(aa_16, rcp_16);
+			
+			__m512 weight_16 = _mm512_mul_ps(nNL_16, ggx_16);
+
+			red_16         = _mm512_fmadd_ps(_mm512_load_ps(norm + x + planeSize),     weight_16, red_16);
+			green_16       = _mm512_fmadd_ps(_mm512_load_ps(norm + x + planeSize * 2), weight_16, green_16);
+			blue_16        = _mm512_fmadd_ps(_mm512_load_ps(norm + x + planeSize * 3), weight_16, blue_16);
+			weightAccum_16 = _mm512_fmadd_ps(_mm512_load_ps(norm + x + planeSize * 4), weight_16, weightAccum_16);
+
+			NL_16 = _mm512_add_ps(NL_16, deltaNL_per16X_16);
+		}
+	}
+	
+ConvolveFinishAVX512Planar:
+	outColor[0] = _mm512_reduce_add_ps(red_16);
+	outColor[1] = _mm512_reduce_add_ps(green_16);
+	outColor[2] = _mm512_reduce_add_ps(blue_16);
+	*outWeightAccum = _mm512_reduce_add_ps(weightAccum_16);
+}
+#endif
+
+void (*convolveFaceToVector)(float[3], float *, float *, float *, int, int, int, float, float) = convolveFaceToVectorScalar;
+
+// ***************************************************************************
+// Blocked kernels, which convolve several neighbouring vectors per pass over the input
+
+#define CONVOLVE_BLOCK_MAX 16
+
+// Sets up a block of vectors for a blocked kernel.
+// The block is padded to a multiple of 4 with vectors that never contribute.
+// Returns the union of the valid Y ranges, or 0 if none.
+static inline int setupVectorBlock(float baseNL[], float deltaNL_perX[], float deltaNL_perY[], int validY[][2], float vN_vE_FaceSpace[][4], int numVectors, int width, int height, float minNL, int *outStartY, int *outEndY)
+{
+	int startY = height, endY = 0;
+	int i;
+
+	for (i = 0; i < ((numVectors + 3) & ~0x03); i++)
+	{
+		validY[i][0] = validY[i][1] = 0;
+
+		if (i >= numVectors)
+		{
+			deltaNL_perX[i] = deltaNL_perY[i] = 0.0f;
+			baseNL[i] = minNL - 1.0f;
+			continue;
+		}
+
+		// delta for NL per coordinate increment
+		deltaNL_perX[i] = vN_vE_FaceSpace[i][0] * 2.0f / width;
+		deltaNL_perY[i] = vN_vE_FaceSpace[i][1] * 2.0f / height;
+
+		// value of NL at left side of texture, at the top
+		baseNL[i] = vN_vE_FaceSpace[i][0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[i][1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[i][2];
+
+		if (calcValidRows(vN_vE_FaceSpace[i], width, height, minNL, &validY[i][0], &validY[i][1]))
+		{
+			startY = MIN(startY, validY[i][0]);
+			endY = MAX(endY, validY[i][1]);
+		}
+	}
+
+	*outStartY = startY;
+	*outEndY = endY;
+	return endY > startY;
+}
+
+// union of the valid X ranges of four vectors on row y
+// returns 0 if none
+static inline int calcBlockColumns(float vN_vE_FaceSpace[][4], int validY[][2], int y, int width, int height, float minNL, int *outStartX, int *outEndX)
+{
+	int startX = width, endX = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		int vecStartX, vecEndX;
+
+		if (y < validY[i][0] || y >= validY[i][1])
+			continue;
+
+		if (calcValidColumns(vN_vE_FaceSpace[i], y, width, height, minNL, &vecStartX, &vecEndX))
+		{
+			startX = MIN(startX, vecStartX);
+			endX = MAX(endX, vecEndX);
+		}
+	}
+
+	*outStartX = startX;
+	*outEndX = endX;
+	return endX > startX;
+}
+
+void convolveFaceToVectorsLoop(float outColor[][3], float outWeightAccum[], float vN_vE_FaceSpace[][4], int numVectors, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	int i;
+	for (i = 0; i < numVectors; i++)
+		convolveFaceToVector(outColor[i], &outWeightAccum[i], vN_vE_FaceSpace[i], inDataFP32, face, width, height, roughness, minNL);
+}
+
+AVX2FUNC void convolveFaceToVectorsAVX2Planar(float outColor[][3], float outWeightAccum[], float vN_vE_FaceSpace[][4], int numVectors, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 red_8[CONVOLVE_BLOCK_MAX], green_8[CONVOLVE_BLOCK_MAX], blue_8[CONVOLVE_BLOCK_MAX], weightAccum_8[CONVOLVE_BLOCK_MAX];
+	float baseNL[CONVOLVE_BLOCK_MAX], deltaNL_perX[CONVOLVE_BLOCK_MAX], deltaNL_perY[CONVOLVE_BLOCK_MAX];
+	int validY[CONVOLVE_BLOCK_MAX][2];
+	int startY, endY, i, k, y;
+
+	for (i = 0; i < CONVOLVE_BLOCK_MAX; i++)
+		red_8[i] = green_8[i] = blue_8[i] = weightAccum_8[i] = _mm256_setzero_ps();
+
+	if (!setupVectorBlock(baseNL, deltaNL_perX, deltaNL_perY, validY, vN_vE_FaceSpace, numVectors, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2Blocked;
+
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	for (y = startY; y < endY; y++)
+	{
+		float *norm = inDataFP32 + face * planeSize * 5 + y * stride;
+		float rowNL[CONVOLVE_BLOCK_MAX];
+
+		for (i = 0; i < numVectors; i += 4)
+		{
+			int startX, endX, x;
+
+			for (k = 0; k < 4; k++)
+				rowNL[i + k] = baseNL[i + k] + deltaNL_perY[i + k] * y;
+
+			// stream the union of the four vectors' spans
+			// each vector masks off texels outside its own
+			if (!calcBlockColumns(vN_vE_FaceSpace + i, validY + i, y, width, height, minNL, &startX, &endX))
+				continue;
+
+			startX = startX & ~0x07;
+
+			__m256 red[4], green[4], blue[4], weightAccum[4], NL_8[4], deltaNL_per8X_8[4];
+			for (k = 0; k < 4; k++)
+			{
+				red[k] = red_8[i + k];
+				green[k] = green_8[i + k];
+				blue[k] = blue_8[i + k];
+				weightAccum[k] = weightAccum_8[i + k];
+				NL_8[k] = _mm256_fmadd_ps(laneX_8, _mm256_set1_ps(deltaNL_perX[i + k]), _mm256_set1_ps(rowNL[i + k] + deltaNL_perX[i + k] * startX));
+				deltaNL_per8X_8[k] = _mm256_set1_ps(deltaNL_perX[i + k] * 8.0f);
+			}
+
+			for (x = startX; x < endX; x += 8)
+			{
+				__m256 norm_8 = _mm256_load_ps(norm + x);
+				__m256 r_8 = _mm256_load_ps(norm + x + planeSize);
+				__m256 g_8 = _mm256_load_ps(norm + x + planeSize * 2);
+				__m256 b_8 = _mm256_load_ps(norm + x + planeSize * 3);
+				__m256 w_8 = _mm256_load_ps(norm + x + planeSize * 4);
+
+				for (k = 0; k < 4; k++)
+				{
+					__m256 nNL_8 = _mm256_mul_ps(NL_8[k], norm_8);
+					nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8[k], minNL_8, _CMP_GT_OQ));
+
+					// aa / (d * d), using a refined reciprocal instead of a divide
+					__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+					ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+					__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+					rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+					ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+
+					__m256 weight_8 = _mm256_mul_ps(nNL_8, ggx_8);
+
+					red[k]         = _mm256_fmadd_ps(r_8, weight_8, red[k]);
+					green[k]       = _mm256_fmadd_ps(g_8, weight_8, green[k]);
+					blue[k]        = _mm256_fmadd_ps(b_8, weight_8, blue[k]);
+					weightAccum[k] = _mm256_fmadd_ps(w_8, weight_8, weightAccum[k]);
+
+					NL_8[k] = _mm256_add_ps(NL_8[k], deltaNL_per8X_8[k]);
+				}
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				red_8[i + k] = red[k];
+				green_8[i + k] = green[k];
+				blue_8[i + k] = blue[k];
+				weightAccum_8[i + k] = weightAccum[k];
+			}
+		}
+	}
+	
+ConvolveFinishAVX2Blocked:
+	for (i = 0; i < numVectors; i++)
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8[i]),         _mm256_extractf128_ps(red_8[i], 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8[i]),       _mm256_extractf128_ps(green_8[i], 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8[i]),        _mm256_extractf128_ps(blue_8[i], 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8[i]), _mm256_extractf128_ps(weightAccum_8[i], 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+		outColor[i][0] = results[0];
+		outColor[i][1] = results[1];
+		outColor[i][2] = results[2];
+		outWeightAccum[i] = results[3];
+	}
+}
+
+#ifdef GGXCC_AVX512
+AVX512FUNC void convolveFaceToVectorsAVX512Planar(float outColor[][3], float outWeightAccum[], float vN_vE_FaceSpace[][4], int numVectors, float *inDataFP32, int face, int width, int height, float roughness, float minNL)
+{
+	__m512 red_16[CONVOLVE_BLOCK_MAX], green_16[CONVOLVE_BLOCK_MAX], blue_16[CONVOLVE_BLOCK_MAX], weightAccum_16[CONVOLVE_BLOCK_MAX];
+	float baseNL[CONVOLVE_BLOCK_MAX], deltaNL_perX[CONVOLVE_BLOCK_MAX], deltaNL_perY[CONVOLVE_BLOCK_MAX];
+	int validY[CONVOLVE_BLOCK_MAX][2];
+	int startY, endY, i, k, y;
+
+	for (i = 0; i < CONVOLVE_BLOCK_MAX; i++)
+		red_16[i] = green_16[i] = blue_16[i] = weightAccum_16[i] = _mm512_setzero_ps();
+
+	if (!setupVectorBlock(baseNL, deltaNL_perX, deltaNL_perY, validY, vN_vE_FaceSpace, numVectors, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX512Blocked;
+
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m512 aa_16 = _mm512_set1_ps(aa);
+	__m512 c1_16 = _mm512_set1_ps(c1);
+	__m512 c2_16 = _mm512_set1_ps(c2);
+	__m512 two_16 = _mm512_set1_ps(2.0f);
+	__m512 minNL_16 = _mm512_set1_ps(minNL);
+	int conic = conicCulling;
+	__m512 laneX_16 = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	for (y = startY; y < endY; y++)
+	{
+		float *norm = inDataFP32 + face * planeSize * 5 + y * stride;
+		float rowNL[CONVOLVE_BLOCK_MAX];
+
+		for (i = 0; i < numVectors; i += 4)
+		{
+			int startX, endX, x;
+
+			for (k = 0; k < 4; k++)
+				rowNL[i + k] = baseNL[i + k] + deltaNL_perY[i + k] * y;
+
+			// stream the union of the four vectors' spans
+			// each vector masks off texels outside its own
+			if (!calcBlockColumns(vN_vE_FaceSpace + i, validY + i, y, width, height, minNL, &startX, &endX))
+				continue;
+
+			startX = startX & ~0x0f;
+
+			__m512 red[4], green[4], blue[4], weightAccum[4], NL_16[4], deltaNL_per16X_16[4];
+			for (k = 0; k < 4; k++)
+			{
+				red[k] = red_16[i + k];
+				green[k] = green_16[i + k];
+				blue[k] = blue_16[i + k];
+				weightAccum[k] = weightAccum_16[i + k];
+				NL_16[k] = _mm512_fmadd_ps(laneX_16, _mm512_set1_ps(deltaNL_perX[i + k]), _mm512_set1_ps(rowNL[i + k] + deltaNL_perX[i + k] * startX));
+				deltaNL_per16X_16[k] = _mm512_set1_ps(deltaNL_perX[i + k] * 16.0f);
+			}
+
+			for (x = startX; x < endX; x += 16)
+			{
+				__m512 norm_16 = _mm512_load_ps(norm + x);
+				__m512 r_16 = _mm512_load_ps(norm + x + planeSize);
+				__m512 g_16 = _mm512_load_ps(norm + x + planeSize * 2);
+				__m512 b_16 = _mm512_load_ps(norm + x + planeSize * 3);
+				__m512 w_16 = _mm512_load_ps(norm + x + planeSize * 4);
+
+				for (k = 0; k < 4; k++)
+				{
+					// texels outside this vector's span get nNL = 0, and so weight = 0
+					__m512 nNL_16 = _mm512_mul_ps(NL_16[k], norm_16);
+					nNL_16 = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(conic ? nNL_16 : NL_16[k], minNL_16, _CMP_GT_OQ), nNL_16);
+
+					// aa / (d * d), using a refined reciprocal instead of a divide
+					__m512 ggx_16 = _mm512_fmadd_ps(nNL_16, c1_16, c2_16);
+					ggx_16 = _mm512_mul_ps(ggx_16, ggx_16);
+					__m512 rcp_16 = _mm512_rcp14_ps(ggx_16);
+					rcp_16 = _mm512_mul_ps(rcp_16, _mm512_fnmadd_ps(ggx_16, rcp_16, two_16));
+					ggx_16 = _mm512_mul_ps(aa_16, rcp_16);
+
+					__m512 weight_16 = _mm512_mul_ps(nNL_16, ggx_16);
+
+					red[k]         = _mm512_fmadd_ps(r_16, weight_16, red[k]);
+					green[k]       = _mm512_fmadd_ps(g_16, weight_16, green[k]);
+					blue[k]        = _mm512_fmadd_ps(b_16, weight_16, blue[k]);
+					weightAccum[k] = _mm512_fmadd_ps(w_16, weight_16, weightAccum[k]);
+
+					NL_16[k] = _mm512_add_ps(NL_16[k], deltaNL_per16X_16[k]);
+				}
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				red_16[i + k] = red[k];
+				green_16[i + k] = green[k];
+				blue_16[i + k] = blue[k];
+				weightAccum_16[i + k] = weightAccum[k];
+			}
+		}
+	}
+	
+ConvolveFinishAVX512Blocked:
+	for (i = 0; i < numVectors; i++)
+	{
+		outColor[i][0] = _mm512_reduce_add_ps(red_16[i]);
+		outColor[i][1] = _mm512_reduce_add_ps(green_16[i]);
+		outColor[i][2] = _mm512_reduce_add_ps(blue_16[i]);
+		outWeightAccum[i] = _mm512_reduce_add_ps(weightAccum_16[i]);
+	}
+}
+#endif
+
+void (*convolveFaceToVectors)(float[][3], float[], float[][4], int, float *, int, int, int, float, float) = convolveFaceToVectorsLoop;
+
+// ***************************************************************************
+// Kernels for the compact FP16 layout
+
+AVX2FUNC void convolveFaceToVectorAVX2PlanarFP16(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP16, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 red_8 = _mm256_setzero_ps();
+	__m256 green_8 = _mm256_setzero_ps();
+	__m256 blue_8 = _mm256_setzero_ps();
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2PlanarFP16;
+
+	baseNL += deltaNL_perY * startY;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	uint16_t *rgbw = (uint16_t *)inDataFP16 + face * planeSize * 4 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 half_8 = _mm256_set1_ps(0.5f);
+	__m256 threeHalves_8 = _mm256_set1_ps(1.5f);
+	__m256 deltaNL_perX_8 = _mm256_set1_ps(deltaNL_perX);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	// face coordinate u per texel
+	__m256 deltaU_perX_8 = _mm256_set1_ps(2.0f / width);
+	__m256 deltaU_per8X_8 = _mm256_set1_ps(16.0f / width);
+	float baseU = -1.0f + 1.0f / width;
+
+	int y;
+	for (y = startY; y < endY; y++, baseNL += deltaNL_perY, rgbw += stride)
+	{
+		int startX, endX, x;
+		if (!calcValidColumns(vN_vE_FaceSpace, y, width, height, minNL, &startX, &endX))
+			continue;
+		
+		startX = startX & ~0x07;
+
+		float v = -1.0f + (2.0f * y + 1.0f) / height;
+		__m256 vv1_8 = _mm256_set1_ps(v * v + 1.0f);
+		
+		__m256 NL_8 = _mm256_fmadd_ps(laneX_8, deltaNL_perX_8, _mm256_set1_ps(baseNL + deltaNL_perX * startX));
+		__m256 u_8 = _mm256_fmadd_ps(laneX_8, deltaU_perX_8, _mm256_set1_ps(baseU + 2.0f * startX / width));
+
+		for (x = startX; x < endX; x += 8)
+		{
+			// inverse length, using a refined reciprocal square root
+			__m256 lengthSq_8 = _mm256_fmadd_ps(u_8, u_8, vv1_8);
+			__m256 norm_8 = _mm256_rsqrt_ps(lengthSq_8);
+			norm_8 = _mm256_mul_ps(norm_8, _mm256_fnmadd_ps(_mm256_mul_ps(half_8, lengthSq_8), _mm256_mul_ps(norm_8, norm_8), threeHalves_8));
+
+			__m256 nNL_8 = _mm256_mul_ps(NL_8, norm_8);
+			nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8, minNL_8, _CMP_GT_OQ));
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+			ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+			__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+			rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+			ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+			
+			__m256 weight_8 = _mm256_mul_ps(nNL_8, ggx_8);
+
+			red_8         = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x))),                 weight_8, red_8);
+			green_8       = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize))),     weight_8, green_8);
+			blue_8        = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize * 2))), weight_8, blue_8);
+			weightAccum_8 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize * 3))), weight_8, weightAccum_8);
+
+			NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8);
+			u_8 = _mm256_add_ps(u_8, deltaU_per8X_8);
+		}
+	}
+	
+ConvolveFinishAVX2PlanarFP16:
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8),         _mm256_extractf128_ps(red_8, 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8),       _mm256_extractf128_ps(green_8, 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8),        _mm256_extractf128_ps(blue_8, 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8), _mm256_extractf128_ps(weightAccum_8, 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+		outColor[0] = results[0];
+		outColor[1] = results[1];
+		outColor[2] = results[2];
+		*outWeightAccum = results[3];
+	}
+}
+
+AVX2FUNC void convolveFaceToVectorsAVX2PlanarFP16(float outColor[][3], float outWeightAccum[], float vN_vE_FaceSpace[][4], int numVectors, float *inDataFP16, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 red_8[CONVOLVE_BLOCK_MAX], green_8[CONVOLVE_BLOCK_MAX], blue_8[CONVOLVE_BLOCK_MAX], weightAccum_8[CONVOLVE_BLOCK_MAX];
+	float baseNL[CONVOLVE_BLOCK_MAX], deltaNL_perX[CONVOLVE_BLOCK_MAX], deltaNL_perY[CONVOLVE_BLOCK_MAX];
+	int validY[CONVOLVE_BLOCK_MAX][2];
+	int startY, endY, i, k, y;
+
+	for (i = 0; i < CONVOLVE_BLOCK_MAX; i++)
+		red_8[i] = green_8[i] = blue_8[i] = weightAccum_8[i] = _mm256_setzero_ps();
+
+	if (!setupVectorBlock(baseNL, deltaNL_perX, deltaNL_perY, validY, vN_vE_FaceSpace, numVectors, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2BlockedFP16;
+
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 half_8 = _mm256_set1_ps(0.5f);
+	__m256 threeHalves_8 = _mm256_set1_ps(1.5f);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	// face coordinate u per texel
+	__m256 deltaU_perX_8 = _mm256_set1_ps(2.0f / width);
+	__m256 deltaU_per8X_8 = _mm256_set1_ps(16.0f / width);
+	float baseU = -1.0f + 1.0f / width;
+
+	for (y = startY; y < endY; y++)
+	{
+		uint16_t *rgbw = (uint16_t *)inDataFP16 + face * planeSize * 4 + y * stride;
+		float rowNL[CONVOLVE_BLOCK_MAX];
+		float v = -1.0f + (2.0f * y + 1.0f) / height;
+		__m256 vv1_8 = _mm256_set1_ps(v * v + 1.0f);
+
+		for (i = 0; i < numVectors; i += 4)
+		{
+			int startX, endX, x;
+
+			for (k = 0; k < 4; k++)
+				rowNL[i + k] = baseNL[i + k] + deltaNL_perY[i + k] * y;
+
+			// stream the union of the four vectors' spans
+			// each vector masks off texels outside its own
+			if (!calcBlockColumns(vN_vE_FaceSpace + i, validY + i, y, width, height, minNL, &startX, &endX))
+				continue;
+
+			startX = startX & ~0x07;
+
+			__m256 red[4], green[4], blue[4], weightAccum[4], NL_8[4], deltaNL_per8X_8[4];
+			for (k = 0; k < 4; k++)
+			{
+				red[k] = red_8[i + k];
+				green[k] = green_8[i + k];
+				blue[k] = blue_8[i + k];
+				weightAccum[k] = weightAccum_8[i + k];
+				NL_8[k] = _mm256_fmadd_ps(laneX_8, _mm256_set1_ps(deltaNL_perX[i + k]), _mm256_set1_ps(rowNL[i + k] + deltaNL_perX[i + k] * startX));
+				deltaNL_per8X_8[k] = _mm256_set1_ps(deltaNL_perX[i + k] * 8.0f);
+			}
+
+			__m256 u_8 = _mm256_fmadd_ps(laneX_8, deltaU_perX_8, _mm256_set1_ps(baseU + 2.0f * startX / width));
+
+			for (x = startX; x < endX; x += 8)
+			{
+				// inverse length, using a refined reciprocal square root
+				__m256 lengthSq_8 = _mm256_fmadd_ps(u_8, u_8, vv1_8);
+				__m256 norm_8 = _mm256_rsqrt_ps(lengthSq_8);
+				norm_8 = _mm256_mul_ps(norm_8, _mm256_fnmadd_ps(_mm256_mul_ps(half_8, lengthSq_8), _mm256_mul_ps(norm_8, norm_8), threeHalves_8));
+
+				__m256 r_8 = _mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x)));
+				__m256 g_8 = _mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize)));
+				__m256 b_8 = _mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize * 2)));
+				__m256 w_8 = _mm256_cvtph_ps(_mm_load_si128((__m128i *)(rgbw + x + planeSize * 3)));
+
+				for (k = 0; k < 4; k++)
+				{
+					__m256 nNL_8 = _mm256_mul_ps(NL_8[k], norm_8);
+					nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8[k], minNL_8, _CMP_GT_OQ));
+
+					// aa / (d * d), using a refined reciprocal instead of a divide
+					__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+					ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+					__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+					rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+					ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+
+					__m256 weight_8 = _mm256_mul_ps(nNL_8, ggx_8);
+
+					red[k]         = _mm256_fmadd_ps(r_8, weight_8, red[k]);
+					green[k]       = _mm256_fmadd_ps(g_8, weight_8, green[k]);
+					blue[k]        = _mm256_fmadd_ps(b_8, weight_8, blue[k]);
+					weightAccum[k] = _mm256_fmadd_ps(w_8, weight_8, weightAccum[k]);
+
+					NL_8[k] = _mm256_add_ps(NL_8[k], deltaNL_per8X_8[k]);
+				}
+
+				u_8 = _mm256_add_ps(u_8, deltaU_per8X_8);
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				red_8[i + k] = red[k];
+				green_8[i + k] = green[k];
+				blue_8[i + k] = blue[k];
+				weightAccum_8[i + k] = weightAccum[k];
+			}
+		}
+	}
+	
+ConvolveFinishAVX2BlockedFP16:
+	for (i = 0; i < numVectors; i++)
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8[i]),         _mm256_extractf128_ps(red_8[i], 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8[i]),       _mm256_extractf128_ps(green_8[i], 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8[i]),        _mm256_extractf128_ps(blue_8[i], 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8[i]), _mm256_extractf128_ps(weightAccum_8[i], 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+		outColor[i][0] = results[0];
+		outColor[i][1] = results[1];
+		outColor[i][2] = results[2];
+		outWeightAccum[i] = results[3];
+	}
+}
+
+#ifdef GGXCC_AVX512
+AVX512FUNC void convolveFaceToVectorAVX512PlanarFP16(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataFP16, int face, int width, int height, float roughness, float minNL)
+{
+	__m512 red_16 = _mm512_setzero_ps();
+	__m512 green_16 = _mm512_setzero_ps();
+	__m512 blue_16 = _mm512_setzero_ps();
+	__m512 weightAccum_16 = _mm512_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX512PlanarFP16;
+
+	baseNL += deltaNL_perY * startY;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	uint16_t *rgbw = (uint16_t *)inDataFP16 + face * planeSize * 4 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m512 aa_16 = _mm512_set1_ps(aa);
+	__m512 c1_16 = _mm512_set1_ps(c1);
+	__m512 c2_16 = _mm512_set1_ps(c2);
+	__m512 two_16 = _mm512_set1_ps(2.0f);
+	__m512 half_16 = _mm512_set1_ps(0.5f);
+	__m512 threeHalves_16 = _mm512_set1_ps(1.5f);
+	__m512 deltaNL_perX_16 = _mm512_set1_ps(deltaNL_perX);
+	__m512 deltaNL_per16X_16 = _mm512_set1_ps(deltaNL_perX * 16.0f);
+	__m512 laneX_16 = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	// face coordinate u per texel
+	__m512 deltaU_perX_16 = _mm512_set1_ps(2.0f / width);
+	__m512 deltaU_per16X_16 = _mm512_set1_ps(32.0f / width);
+	float baseU = -1.0f + 1.0f / width;
+
+	int y;
+	for (y = startY; y < endY; y++, baseNL += deltaNL_perY, rgbw += stride)
+	{
+		int startX, endX, x;
+		if (!calcValidColumns(vN_vE_FaceSpace, y, width, height, minNL, &startX, &endX))
+			continue;
+
+		// mask off the texels outside of [startX, endX) in the first and last vectors
+		__mmask16 mask = (__mmask16)(0xffff << (startX & 0x0f));
+		__mmask16 lastMask = (__mmask16)(0xffff >> (15 - ((endX - 1) & 0x0f)));
+
+		x = startX & ~0x0f;
+
+		float v = -1.0f + (2.0f * y + 1.0f) / height;
+		__m512 vv1_16 = _mm512_set1_ps(v * v + 1.0f);
+		
+		__m512 NL_16 = _mm512_fmadd_ps(laneX_16, deltaNL_perX_16, _mm512_set1_ps(baseNL + deltaNL_perX * x));
+		__m512 u_16 = _mm512_fmadd_ps(laneX_16, deltaU_perX_16, _mm512_set1_ps(baseU + 2.0f * x / width));
+
+		for (; x < endX; x += 16, mask = 0xffff)
+		{
+			if (x + 16 >= endX)
+				mask &= lastMask;
+
+			// inverse length, using a refined reciprocal square root
+			__m512 lengthSq_16 = _mm512_fmadd_ps(u_16, u_16, vv1_16);
+			__m512 norm_16 = _mm512_rsqrt14_ps(lengthSq_16);
+			norm_16 = _mm512_mul_ps(norm_16, _mm512_fnmadd_ps(_mm512_mul_ps(half_16, lengthSq_16), _mm512_mul_ps(norm_16, norm_16), threeHalves_16));
+
+			// masked off texels get nNL = 0, and so weight = 0
+			__m512 nNL_16 = _mm512_maskz_mul_ps(mask, NL_16, norm_16);
+			nNL_16 = _mm512_max_ps(nNL_16, _mm512_setzero_ps());
+		
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m512 ggx_16 = _mm512_fmadd_ps(nNL_16, c1_16, c2_16);
+			ggx_16 = _mm512_mul_ps(ggx_16, ggx_16);
+			__m512 rcp_16 = _mm512_rcp14_ps(ggx_16);
+			rcp_16 = _mm512_mul_ps(rcp_16, _mm512_fnmadd_ps(ggx_16, rcp_16, two_16));
+			ggx_16 = _mm512_mul_ps(aa_16, rcp_16);
+			
+			__m512 weight_16 = _mm512_mul_ps(nNL_16, ggx_16);
+
+			red_16         = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x))),                 weight_16, red_16);
+			green_16       = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize))),     weight_16, green_16);
+			blue_16        = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize * 2))), weight_16, blue_16);
+			weightAccum_16 = _mm512_fmadd_ps(_mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize * 3))), weight_16, weightAccum_16);
+
+			NL_16 = _mm512_add_ps(NL_16, deltaNL_per16X_16);
+			u_16 = _mm512_add_ps(u_16, deltaU_per16X_16);
+		}
+	}
+	
+ConvolveFinishAVX512PlanarFP16:
+	outColor[0] = _mm512_reduce_add_ps(red_16);
+	outColor[1] = _mm512_reduce_add_ps(green_16);
+	outColor[2] = _mm512_reduce_add_ps(blue_16);
+	*outWeightAccum = _mm512_reduce_add_ps(weightAccum_16);
+}
+
+AVX512FUNC void convolveFaceToVectorsAVX512PlanarFP16(float outColor[][3], float outWeightAccum[], float vN_vE_FaceSpace[][4], int numVectors, float *inDataFP16, int face, int width, int height, float roughness, float minNL)
+{
+	__m512 red_16[CONVOLVE_BLOCK_MAX], green_16[CONVOLVE_BLOCK_MAX], blue_16[CONVOLVE_BLOCK_MAX], weightAccum_16[CONVOLVE_BLOCK_MAX];
+	float baseNL[CONVOLVE_BLOCK_MAX], deltaNL_perX[CONVOLVE_BLOCK_MAX], deltaNL_perY[CONVOLVE_BLOCK_MAX];
+	int validY[CONVOLVE_BLOCK_MAX][2];
+	int startY, endY, i, k, y;
+
+	for (i = 0; i < CONVOLVE_BLOCK_MAX; i++)
+		red_16[i] = green_16[i] = blue_16[i] = weightAccum_16[i] = _mm512_setzero_ps();
+
+	if (!setupVectorBlock(baseNL, deltaNL_perX, deltaNL_perY, validY, vN_vE_FaceSpace, numVectors, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX512BlockedFP16;
+
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m512 aa_16 = _mm512_set1_ps(aa);
+	__m512 c1_16 = _mm512_set1_ps(c1);
+	__m512 c2_16 = _mm512_set1_ps(c2);
+	__m512 two_16 = _mm512_set1_ps(2.0f);
+	__m512 half_16 = _mm512_set1_ps(0.5f);
+	__m512 threeHalves_16 = _mm512_set1_ps(1.5f);
+	__m512 minNL_16 = _mm512_set1_ps(minNL);
+	int conic = conicCulling;
+	__m512 laneX_16 = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	// face coordinate u per texel
+	__m512 deltaU_perX_16 = _mm512_set1_ps(2.0f / width);
+	__m512 deltaU_per16X_16 = _mm512_set1_ps(32.0f / width);
+	float baseU = -1.0f + 1.0f / width;
+
+	for (y = startY; y < endY; y++)
+	{
+		uint16_t *rgbw = (uint16_t *)inDataFP16 + face * planeSize * 4 + y * stride;
+		float rowNL[CONVOLVE_BLOCK_MAX];
+		float v = -1.0f + (2.0f * y + 1.0f) / height;
+		__m512 vv1_16 = _mm512_set1_ps(v * v + 1.0f);
+
+		for (i = 0; i < numVectors; i += 4)
+		{
+			int startX, endX, x;
+
+			for (k = 0; k < 4; k++)
+				rowNL[i + k] = baseNL[i + k] + deltaNL_perY[i + k] * y;
+
+			// stream the union of the four vectors' spans
+			// each vector masks off texels outside its own
+			if (!calcBlockColumns(vN_vE_FaceSpace + i, validY + i, y, width, height, minNL, &startX, &endX))
+				continue;
+
+			startX = startX & ~0x0f;
+
+			__m512 red[4], green[4], blue[4], weightAccum[4], NL_16[4], deltaNL_per16X_16[4];
+			for (k = 0; k < 4; k++)
+			{
+				red[k] = red_16[i + k];
+				green[k] = green_16[i + k];
+				blue[k] = blue_16[i + k];
+				weightAccum[k] = weightAccum_16[i + k];
+				NL_16[k] = _mm512_fmadd_ps(laneX_16, _mm512_set1_ps(deltaNL_perX[i + k]), _mm512_set1_ps(rowNL[i + k] + deltaNL_perX[i + k] * startX));
+				deltaNL_per16X_16[k] = _mm512_set1_ps(deltaNL_perX[i + k] * 16.0f);
+			}
+
+			__m512 u_16 = _mm512_fmadd_ps(laneX_16, deltaU_perX_16, _mm512_set1_ps(baseU + 2.0f * startX / width));
+
+			for (x = startX; x < endX; x += 16)
+			{
+				// inverse length, using a refined reciprocal square root
+				__m512 lengthSq_16 = _mm512_fmadd_ps(u_16, u_16, vv1_16);
+				__m512 norm_16 = _mm512_rsqrt14_ps(lengthSq_16);
+				norm_16 = _mm512_mul_ps(norm_16, _mm512_fnmadd_ps(_mm512_mul_ps(half_16, lengthSq_16), _mm512_mul_ps(norm_16, norm_16), threeHalves_16));
+
+				__m512 r_16 = _mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x)));
+				__m512 g_16 = _mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize)));
+				__m512 b_16 = _mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize * 2)));
+				__m512 w_16 = _mm512_cvtph_ps(_mm256_load_si256((__m256i *)(rgbw + x + planeSize * 3)));
+
+				for (k = 0; k < 4; k++)
+				{
+					// texels outside this vector's span get nNL = 0, and so weight = 0
+					__m512 nNL_16 = _mm512_mul_ps(NL_16[k], norm_16);
+					nNL_16 = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(conic ? nNL_16 : NL_16[k], minNL_16, _CMP_GT_OQ), nNL_16);
+
+					// aa / (d * d), using a refined reciprocal instead of a divide
+					__m512 ggx_16 = _mm512_fmadd_ps(nNL_16, c1_16, c2_16);
+					ggx_16 = _mm512_mul_ps(ggx_16, ggx_16);
+					__m512 rcp_16 = _mm512_rcp14_ps(ggx_16);
+					rcp_16 = _mm512_mul_ps(rcp_16, _mm512_fnmadd_ps(ggx_16, rcp_16, two_16));
+					ggx_16 = _mm512_mul_ps(aa_16, rcp_16);
+
+					__m512 weight_16 = _mm512_mul_ps(nNL_16, ggx_16);
+
+					red[k]         = _mm512_fmadd_ps(r_16, weight_16, red[k]);
+					green[k]       = _mm512_fmadd_ps(g_16, weight_16, green[k]);
+					blue[k]        = _mm512_fmadd_ps(b_16, weight_16, blue[k]);
+					weightAccum[k] = _mm512_fmadd_ps(w_16, weight_16, weightAccum[k]);
+
+					NL_16[k] = _mm512_add_ps(NL_16[k], deltaNL_per16X_16[k]);
+				}
+
+				u_16 = _mm512_add_ps(u_16, deltaU_per16X_16);
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				red_16[i + k] = red[k];
+				green_16[i + k] = green[k];
+				blue_16[i + k] = blue[k];
+				weightAccum_16[i + k] = weightAccum[k];
+			}
+		}
+	}
+	
+ConvolveFinishAVX512BlockedFP16:
+	for (i = 0; i < numVectors; i++)
+	{
+		outColor[i][0] = _mm512_reduce_add_ps(red_16[i]);
+		outColor[i][1] = _mm512_reduce_add_ps(green_16[i]);
+		outColor[i][2] = _mm512_reduce_add_ps(blue_16[i]);
+		outWeightAccum[i] = _mm512_reduce_add_ps(weightAccum_16[i]);
+	}
+}
+#endif
+
+// ***************************************************************************
+// Kernel for the integer layout
+//
+// Weights are computed in float, then quantized to 15 bits relative to the
+// weight of the texel nearest the lobe center, and accumulated against the
+// 12 bit colours with pmaddwd.  Each pmaddwd lane sums two products of at
+// most 2^27, so eight of them fit in a dword before being flushed to the
+// float accumulators.
+
+// Estimate the largest unscaled weight for a vector, from the texel nearest the
+// lobe center and the center of the same face, since solid angle can outweigh
+// wide lobes.  Every face gets the same result for the same vector, so weights
+// quantized against it can be summed across faces.
+static inline float calcPeakWeight(float vN_vE_FaceSpace[3], int inRes, float c1, float c2)
+{
+	float a = fabsf(vN_vE_FaceSpace[0]);
+	float b = fabsf(vN_vE_FaceSpace[1]);
+	float m = fabsf(vN_vE_FaceSpace[2]);
+	float t;
+
+	// put the major axis last, the cube is symmetric so only magnitudes matter
+	if (a > m) { t = a; a = m; m = t; }
+	if (b > m) { t = b; b = m; m = t; }
+
+	// snap to the center of the texel containing the vector
+	float u = (floorf((a / m + 1.0f) * 0.5f * inRes) + 0.5f) * 2.0f / inRes - 1.0f;
+	float v = (floorf((b / m + 1.0f) * 0.5f * inRes) + 0.5f) * 2.0f / inRes - 1.0f;
+	float norm = 1.0f / sqrtf(u * u + v * v + 1.0f);
+	float nNL = (a * u + b * v + m) * norm;
+	float d = nNL * c1 + c2;
+	float centerD = m * c1 + c2;
+
+	return MAX(nNL / (d * d) * norm * norm * norm, m / (centerD * centerD));
+}
+
+AVX2FUNC void convolveFaceToVectorAVX2PlanarInt16(float outColor[3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inDataInt16, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 red_8 = _mm256_setzero_ps();
+	__m256 green_8 = _mm256_setzero_ps();
+	__m256 blue_8 = _mm256_setzero_ps();
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishAVX2PlanarInt16;
+
+	baseNL += deltaNL_perY * startY;
+	
+	// planes have rows padded to a multiple of 16 texels
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	int16_t *rgb = (int16_t *)inDataInt16 + face * planeSize * 3 + startY * stride;
+	
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	// the peak texel maps to half of the range, leaving headroom for texels
+	// slightly nearer the center of the lobe
+	__m256 weightScale_8 = _mm256_set1_ps(16384.0f / calcPeakWeight(vN_vE_FaceSpace, width, c1, c2));
+	__m256 weightMax_8 = _mm256_set1_ps(32767.0f);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 half_8 = _mm256_set1_ps(0.5f);
+	__m256 threeHalves_8 = _mm256_set1_ps(1.5f);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 deltaNL_perX_8 = _mm256_set1_ps(deltaNL_perX);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	__m256i ones_16 = _mm256_set1_epi16(1);
+
+	// padding texels have zero colour, but must also be kept out of the weight sum
+	int16_t tailOnes[16];
+	int lane;
+	for (lane = 0; lane < 16; lane++)
+		tailOnes[lane] = int16PackOrder[lane] < (width & 0x0f);
+	__m256i tailOnes_16 = _mm256_loadu_si256((__m256i *)tailOnes);
+
+	// face coordinate u per texel
+	__m256 deltaU_perX_8 = _mm256_set1_ps(2.0f / width);
+	__m256 deltaU_per8X_8 = _mm256_set1_ps(16.0f / width);
+	float baseU = -1.0f + 1.0f / width;
+
+	int y;
+	for (y = startY; y < endY; y++, baseNL += deltaNL_perY, rgb += stride)
+	{
+		int startX, endX, x;
+		if (!calcValidColumns(vN_vE_FaceSpace, y, width, height, minNL, &startX, &endX))
+			continue;
+		
+		startX = startX & ~0x0f;
+
+		float v = -1.0f + (2.0f * y + 1.0f) / height;
+		__m256 vv1_8 = _mm256_set1_ps(v * v + 1.0f);
+		
+		__m256 NL_8 = _mm256_fmadd_ps(laneX_8, deltaNL_perX_8, _mm256_set1_ps(baseNL + deltaNL_perX * startX));
+		__m256 u_8 = _mm256_fmadd_ps(laneX_8, deltaU_perX_8, _mm256_set1_ps(baseU + 2.0f * startX / width));
+
+		while (startX < endX)
+		{
+			__m256i red_i = _mm256_setzero_si256();
+			__m256i green_i = _mm256_setzero_si256();
+			__m256i blue_i = _mm256_setzero_si256();
+			__m256i weightAccum_i = _mm256_setzero_si256();
+
+			// up to eight iterations before the dword accumulators could overflow
+			int flushX = MIN(endX, startX + 8 * 16);
+			for (x = startX; x < flushX; x += 16)
+			{
+				__m256 weight_8[2];
+				int i;
+
+				for (i = 0; i < 2; i++)
+				{
+					// inverse length, using a refined reciprocal square root
+					__m256 lengthSq_8 = _mm256_fmadd_ps(u_8, u_8, vv1_8);
+					__m256 norm_8 = _mm256_rsqrt_ps(lengthSq_8);
+					norm_8 = _mm256_mul_ps(norm_8, _mm256_fnmadd_ps(_mm256_mul_ps(half_8, lengthSq_8), _mm256_mul_ps(norm_8, norm_8), threeHalves_8));
+
+					// texels outside the span get nNL = 0, and so weight = 0
+					__m256 nNL_8 = _mm256_mul_ps(NL_8, norm_8);
+					nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8, minNL_8, _CMP_GT_OQ));
+
+					// 1 / (d * d), using a refined reciprocal instead of a divide
+					__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+					ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+					__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+					rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+
+					// solid angle is proportional to inverse length cubed
+					__m256 solidAngle_8 = _mm256_mul_ps(_mm256_mul_ps(norm_8, norm_8), norm_8);
+					weight_8[i] = _mm256_mul_ps(_mm256_mul_ps(nNL_8, rcp_8), _mm256_mul_ps(solidAngle_8, weightScale_8));
+					weight_8[i] = _mm256_min_ps(weight_8[i], weightMax_8);
+
+					NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8);
+					u_8 = _mm256_add_ps(u_8, deltaU_per8X_8);
+				}
+
+				// matches the order of texels in the layout
+				__m256i weight_16 = _mm256_packs_epi32(_mm256_cvtps_epi32(weight_8[0]), _mm256_cvtps_epi32(weight_8[1]));
+
+				red_i         = _mm256_add_epi32(red_i,         _mm256_madd_epi16(_mm256_load_si256((__m256i *)(rgb + x)),                 weight_16));
+				green_i       = _mm256_add_epi32(green_i,       _mm256_madd_epi16(_mm256_load_si256((__m256i *)(rgb + x + planeSize)),     weight_16));
+				blue_i        = _mm256_add_epi32(blue_i,        _mm256_madd_epi16(_mm256_load_si256((__m256i *)(rgb + x + planeSize * 2)), weight_16));
+				weightAccum_i = _mm256_add_epi32(weightAccum_i, _mm256_madd_epi16(x + 16 > width ? tailOnes_16 : ones_16, weight_16));
+			}
+
+			red_8         = _mm256_add_ps(red_8,         _mm256_cvtepi32_ps(red_i));
+			green_8       = _mm256_add_ps(green_8,       _mm256_cvtepi32_ps(green_i));
+			blue_8        = _mm256_add_ps(blue_8,        _mm256_cvtepi32_ps(blue_i));
+			weightAccum_8 = _mm256_add_ps(weightAccum_8, _mm256_cvtepi32_ps(weightAccum_i));
+
+			startX = flushX;
+		}
+	}
+	
+ConvolveFinishAVX2PlanarInt16:
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8),         _mm256_extractf128_ps(red_8, 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8),       _mm256_extractf128_ps(green_8, 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8),        _mm256_extractf128_ps(blue_8, 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8), _mm256_extractf128_ps(weightAccum_8, 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+
+		// colors are in fixed point
+		outColor[0] = results[0] * (1.0f / INT16_COLOR_SCALE);
+		outColor[1] = results[1] * (1.0f / INT16_COLOR_SCALE);
+		outColor[2] = results[2] * (1.0f / INT16_COLOR_SCALE);
+		*outWeightAccum = results[3];
+	}
+}
+
+// ***************************************************************************
+// Hierarchical tile culling
+//
+// Each face of the planar layout is split into 8x8 tiles, grouped again into
+// 32x32 tiles.  Every tile stores the cone of directions it covers and its
+// summed R * solid angle, G * solid angle, B * solid angle, and solid angle.
+// From the angle between a vector and a tile's center, the cone bounds nNL
+// over the tile, and so bounds the GGX weight, since D(nNL) * nNL increases
+// with nNL.  Tiles where the weight can't vary by more than epsilon of the
+// lobe's total are replaced by their aggregate, larger tiles are split, and
+// the rest are convolved texel by texel.
+
+#define TILE_SIZE 8
+#define TILE_GROUP 4
+
+typedef struct
+{
+	float dir[3];
+	float cosAngle;
+	float sinAngle;
+	float rgbw[4];
+}
+tile_t;
+
+float tileEpsilon = 0.0f;
+int tilesX, tilesY, groupsX, groupsY;
+tile_t *fineTiles = NULL;
+tile_t *coarseTiles = NULL;
+
+// direction of the tile center, and the cone around it reaching all corners
+void calcTileCone(tile_t *tile, int x0, int y0, int x1, int y1, int width, int height)
+{
+	float u[2] = { -1.0f + 2.0f * x0 / width, -1.0f + 2.0f * x1 / width };
+	float v[2] = { -1.0f + 2.0f * y0 / height, -1.0f + 2.0f * y1 / height };
+	int i;
+
+	Vec3Set(tile->dir, (u[0] + u[1]) * 0.5f, (v[0] + v[1]) * 0.5f, 1.0f);
+	Vec3Normalize(tile->dir);
+
+	tile->cosAngle = 1.0f;
+	for (i = 0; i < 4; i++)
+	{
+		vec3_t corner;
+		Vec3Set(corner, u[i & 1], v[i >> 1], 1.0f);
+		Vec3Normalize(corner);
+		tile->cosAngle = MIN(tile->cosAngle, DotProduct(tile->dir, corner));
+	}
+	tile->sinAngle = sqrtf(MAX(1.0f - tile->cosAngle * tile->cosAngle, 0.0f));
+}
+
+void buildTileHierarchy(float *inDataFP32, int width, int height)
+{
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	int face, tx, ty, x, y, i;
+
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	groupsX = (tilesX + TILE_GROUP - 1) / TILE_GROUP;
+	groupsY = (tilesY + TILE_GROUP - 1) / TILE_GROUP;
+
+	fineTiles = malloc(tilesX * tilesY * 6 * sizeof(*fineTiles));
+	coarseTiles = malloc(groupsX * groupsY * 6 * sizeof(*coarseTiles));
+
+	for (face = 0; face < 6; face++)
+	{
+		float *planes = inDataFP32 + face * planeSize * 5;
+
+		for (ty = 0; ty < tilesY; ty++)
+		{
+			for (tx = 0; tx < tilesX; tx++)
+			{
+				tile_t *tile = &fineTiles[(face * tilesY + ty) * tilesX + tx];
+				int x0 = tx * TILE_SIZE, x1 = MIN(x0 + TILE_SIZE, width);
+				int y0 = ty * TILE_SIZE, y1 = MIN(y0 + TILE_SIZE, height);
+
+				calcTileCone(tile, x0, y0, x1, y1, width, height);
+
+				for (i = 0; i < 4; i++)
+				{
+					tile->rgbw[i] = 0.0f;
+					for (y = y0; y < y1; y++)
+						for (x = x0; x < x1; x++)
+							tile->rgbw[i] += planes[planeSize * (i + 1) + y * stride + x];
+				}
+			}
+		}
+
+		for (ty = 0; ty < groupsY; ty++)
+		{
+			for (tx = 0; tx < groupsX; tx++)
+			{
+				tile_t *group = &coarseTiles[(face * groupsY + ty) * groupsX + tx];
+				int x0 = tx * TILE_GROUP * TILE_SIZE, x1 = MIN(x0 + TILE_GROUP * TILE_SIZE, width);
+				int y0 = ty * TILE_GROUP * TILE_SIZE, y1 = MIN(y0 + TILE_GROUP * TILE_SIZE, height);
+
+				calcTileCone(group, x0, y0, x1, y1, width, height);
+
+				for (i = 0; i < 4; i++)
+				{
+					group->rgbw[i] = 0.0f;
+					for (y = y0 / TILE_SIZE; y < (y1 + TILE_SIZE - 1) / TILE_SIZE; y++)
+						for (x = x0 / TILE_SIZE; x < (x1 + TILE_SIZE - 1) / TILE_SIZE; x++)
+							group->rgbw[i] += fineTiles[(face * tilesY + y) * tilesX + x].rgbw[i];
+				}
+			}
+		}
+	}
+}
+
+// Convolve the texels of one tile, columns [x0, x0 + TILE_SIZE) and rows [y0, y1),
+// adding to rgbw.  Columns past the face are padding with zero solid angle.
+
+void convolveTileToVectorScalar(float rgbw[4], float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, int x0, int y0, int y1, float aa)
+{
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + y0 * stride + x0;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x0 + 1.0f) / width) + vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y0 + 1.0f) / height) + vN_vE_FaceSpace[2];
+	int x, y;
+
+	for (y = y0; y < y1; y++, norm += stride, baseNL += deltaNL_perY)
+	{
+		for (x = 0; x < TILE_SIZE; x++)
+		{
+			float nNL = MAX((baseNL + deltaNL_perX * x) * norm[x], 0.0f);
+			float d = nNL * c1 + c2;
+			float weight = aa / (d * d) * nNL;
+
+			rgbw[0] += norm[x + planeSize] * weight;
+			rgbw[1] += norm[x + planeSize * 2] * weight;
+			rgbw[2] += norm[x + planeSize * 3] * weight;
+			rgbw[3] += norm[x + planeSize * 4] * weight;
+		}
+	}
+}
+
+SSE2FUNC void convolveTileToVectorSSE2(float rgbw[4], float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, int x0, int y0, int y1, float aa)
+{
+	__m128 red_4 = _mm_setzero_ps();
+	__m128 green_4 = _mm_setzero_ps();
+	__m128 blue_4 = _mm_setzero_ps();
+	__m128 weightAccum_4 = _mm_setzero_ps();
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + y0 * stride + x0;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x0 + 1.0f) / width) + vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y0 + 1.0f) / height) + vN_vE_FaceSpace[2];
+	int y, i;
+
+	__m128 aa_4 = _mm_set1_ps(aa);
+	__m128 c1_4 = _mm_set1_ps(c1);
+	__m128 c2_4 = _mm_set1_ps(c2);
+	__m128 two_4 = _mm_set1_ps(2.0f);
+	__m128 deltaNL_per4X_4 = _mm_set1_ps(deltaNL_perX * 4.0f);
+	__m128 deltaNL_perY_4 = _mm_set1_ps(deltaNL_perY);
+	__m128 NL_4 = _mm_setr_ps(baseNL, baseNL + deltaNL_perX, baseNL + 2.0f * deltaNL_perX, baseNL + 3.0f * deltaNL_perX);
+
+	for (y = y0; y < y1; y++, norm += stride, NL_4 = _mm_add_ps(NL_4, deltaNL_perY_4))
+	{
+		for (i = 0; i < TILE_SIZE; i += 4)
+		{
+			__m128 nNL_4 = _mm_mul_ps(_mm_add_ps(NL_4, i ? deltaNL_per4X_4 : _mm_setzero_ps()), _mm_load_ps(norm + i));
+			nNL_4 = _mm_max_ps(nNL_4, _mm_setzero_ps());
+
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m128 ggx_4 = _mm_add_ps(_mm_mul_ps(nNL_4, c1_4), c2_4);
+			ggx_4 = _mm_mul_ps(ggx_4, ggx_4);
+			__m128 rcp_4 = _mm_rcp_ps(ggx_4);
+			rcp_4 = _mm_mul_ps(rcp_4, _mm_sub_ps(two_4, _mm_mul_ps(ggx_4, rcp_4)));
+
+			__m128 weight_4 = _mm_mul_ps(nNL_4, _mm_mul_ps(aa_4, rcp_4));
+
+			red_4         = _mm_add_ps(red_4,         _mm_mul_ps(_mm_load_ps(norm + i + planeSize),     weight_4));
+			green_4       = _mm_add_ps(green_4,       _mm_mul_ps(_mm_load_ps(norm + i + planeSize * 2), weight_4));
+			blue_4        = _mm_add_ps(blue_4,        _mm_mul_ps(_mm_load_ps(norm + i + planeSize * 3), weight_4));
+			weightAccum_4 = _mm_add_ps(weightAccum_4, _mm_mul_ps(_mm_load_ps(norm + i + planeSize * 4), weight_4));
+		}
+	}
+
+	{
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+
+		for (i = 0; i < 4; i++)
+			rgbw[i] += results[i];
+	}
+}
+
+AVX2FUNC void convolveTileToVectorAVX2(float rgbw[4], float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, int x0, int y0, int y1, float aa)
+{
+	__m256 red_8 = _mm256_setzero_ps();
+	__m256 green_8 = _mm256_setzero_ps();
+	__m256 blue_8 = _mm256_setzero_ps();
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float *norm = inDataFP32 + face * planeSize * 5 + y0 * stride + x0;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x0 + 1.0f) / width) + vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y0 + 1.0f) / height) + vN_vE_FaceSpace[2];
+	int y, i;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 deltaNL_perY_8 = _mm256_set1_ps(deltaNL_perY);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	__m256 NL_8 = _mm256_fmadd_ps(laneX_8, _mm256_set1_ps(deltaNL_perX), _mm256_set1_ps(baseNL));
+
+	// a tile row is one vector
+	for (y = y0; y < y1; y++, norm += stride, NL_8 = _mm256_add_ps(NL_8, deltaNL_perY_8))
+	{
+		__m256 nNL_8 = _mm256_mul_ps(NL_8, _mm256_load_ps(norm));
+		nNL_8 = _mm256_max_ps(nNL_8, _mm256_setzero_ps());
+
+		// aa / (d * d), using a refined reciprocal instead of a divide
+		__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+		ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+		__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+		rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+
+		__m256 weight_8 = _mm256_mul_ps(nNL_8, _mm256_mul_ps(aa_8, rcp_8));
+
+		red_8         = _mm256_fmadd_ps(_mm256_load_ps(norm + planeSize),     weight_8, red_8);
+		green_8       = _mm256_fmadd_ps(_mm256_load_ps(norm + planeSize * 2), weight_8, green_8);
+		blue_8        = _mm256_fmadd_ps(_mm256_load_ps(norm + planeSize * 3), weight_8, blue_8);
+		weightAccum_8 = _mm256_fmadd_ps(_mm256_load_ps(norm + planeSize * 4), weight_8, weightAccum_8);
+	}
+
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8),         _mm256_extractf128_ps(red_8, 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8),       _mm256_extractf128_ps(green_8, 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8),        _mm256_extractf128_ps(blue_8, 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8), _mm256_extractf128_ps(weightAccum_8, 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+
+		for (i = 0; i < 4; i++)
+			rgbw[i] += results[i];
+	}
+}
+
+void (*convolveTileToVector)(float[4], float *, float *, int, int, int, int, int, int, float) = convolveTileToVectorScalar;
+
+// ***************************************************************************
+// Small lobe window kernels
+//
+// Weight the texels of one face in [startX, endX) x [startY, endY) with
+// nNL > cutoff, for the small lobe fast path below.  Windows are a few texels
+// wide, so the AVX2 version masks its loads instead of padding rows.
+
+void convolveWindowToVectorScalar(float rgbw[4], float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, int startX, int endX, int startY, int endY, float aa, float cutoff)
+{
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	int x, y;
+
+	for (y = startY; y < endY; y++)
+	{
+		float *norm = inDataFP32 + face * planeSize * 5 + y * stride;
+		float NL = vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y + 1.0f) / height) + vN_vE_FaceSpace[2];
+
+		for (x = startX; x < endX; x++)
+		{
+			float nNL = (vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x + 1.0f) / width) + NL) * norm[x];
+
+			if (nNL <= cutoff)
+				continue;
+
+			float d = nNL * c1 + c2;
+			float weight = aa / (d * d) * nNL;
+
+			rgbw[0] += norm[x + planeSize] * weight;
+			rgbw[1] += norm[x + planeSize * 2] * weight;
+			rgbw[2] += norm[x + planeSize * 3] * weight;
+			rgbw[3] += norm[x + planeSize * 4] * weight;
+		}
+	}
+}
+
+AVX2FUNC void convolveWindowToVectorAVX2(float rgbw[4], float *vN_vE_FaceSpace, float *inDataFP32, int face, int width, int height, int startX, int endX, int startY, int endY, float aa, float cutoff)
+{
+	__m256 red_8 = _mm256_setzero_ps();
+	__m256 green_8 = _mm256_setzero_ps();
+	__m256 blue_8 = _mm256_setzero_ps();
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	int stride = (width + 15) & ~0x0f;
+	int planeSize = stride * height;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	int x, y, i;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 cutoff_8 = _mm256_set1_ps(cutoff);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneNL_8 = _mm256_mul_ps(_mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f), _mm256_set1_ps(deltaNL_perX));
+	__m256i laneX_8 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i endX_8 = _mm256_set1_epi32(endX);
+
+	for (y = startY; y < endY; y++)
+	{
+		float *norm = inDataFP32 + face * planeSize * 5 + y * stride;
+		float NL = vN_vE_FaceSpace[0] * (-1.0f + (2.0f * startX + 1.0f) / width) + vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y + 1.0f) / height) + vN_vE_FaceSpace[2];
+		__m256 NL_8 = _mm256_add_ps(_mm256_set1_ps(NL), laneNL_8);
+
+		for (x = startX; x < endX; x += 8, NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8))
+		{
+			// lanes past the window aren't loaded
+			__m256i inside_8 = _mm256_cmpgt_epi32(endX_8, _mm256_add_epi32(_mm256_set1_epi32(x), laneX_8));
+			__m256 nNL_8 = _mm256_mul_ps(NL_8, _mm256_maskload_ps(norm + x, inside_8));
+			__m256 valid_8 = _mm256_and_ps(_mm256_castsi256_ps(inside_8), _mm256_cmp_ps(nNL_8, cutoff_8, _CMP_GT_OQ));
+
+			// aa / (d * d), using a refined reciprocal instead of a divide
+			__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+			ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+			__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+			rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+
+			__m256 weight_8 = _mm256_and_ps(valid_8, _mm256_mul_ps(nNL_8, _mm256_mul_ps(aa_8, rcp_8)));
+
+			red_8         = _mm256_fmadd_ps(_mm256_maskload_ps(norm + x + planeSize,     inside_8), weight_8, red_8);
+			green_8       = _mm256_fmadd_ps(_mm256_maskload_ps(norm + x + planeSize * 2, inside_8), weight_8, green_8);
+			blue_8        = _mm256_fmadd_ps(_mm256_maskload_ps(norm + x + planeSize * 3, inside_8), weight_8, blue_8);
+			weightAccum_8 = _mm256_fmadd_ps(_mm256_maskload_ps(norm + x + planeSize * 4, inside_8), weight_8, weightAccum_8);
+		}
+	}
+
+	{
+		__m128 red_4         = _mm_add_ps(_mm256_castps256_ps128(red_8),         _mm256_extractf128_ps(red_8, 1));
+		__m128 green_4       = _mm_add_ps(_mm256_castps256_ps128(green_8),       _mm256_extractf128_ps(green_8, 1));
+		__m128 blue_4        = _mm_add_ps(_mm256_castps256_ps128(blue_8),        _mm256_extractf128_ps(blue_8, 1));
+		__m128 weightAccum_4 = _mm_add_ps(_mm256_castps256_ps128(weightAccum_8), _mm256_extractf128_ps(weightAccum_8, 1));
+		ALIGN16 float results[4];
+
+		// transpose and sum, so each lane holds the total of one channel
+		_MM_TRANSPOSE4_PS(red_4, green_4, blue_4, weightAccum_4);
+		_mm_store_ps(results, _mm_add_ps(_mm_add_ps(red_4, green_4), _mm_add_ps(blue_4, weightAccum_4)));
+
+		for (i = 0; i < 4; i++)
+			rgbw[i] += results[i];
+	}
+}
+
+void (*convolveWindowToVector)(float[4], float *, float *, int, int, int, int, int, int, int, float, float) = convolveWindowToVectorScalar;
+
+// ***************************************************************************
+// Batch kernels
+//
+// The weight of a texel only depends on the vector and roughness, so a batch
+// of same size cubemaps shares it.  Each row of the batch layout is stored as
+// spans of inverse length and solid angle, followed by R, G, and B times solid
+// angle for each cubemap, with spans padded like the rows of the planar
+// layout.  The kernels compute the weights of a run of texels once, then
+// accumulate them into each cubemap's color in turn.
+
+#define BATCH_MAX 64
+#define BATCH_RUN 256
+
+void convolveFaceToVectorBatchScalar(float outColor[][3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inData, int numMaps, int face, int width, int height, float roughness, float minNL)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float weightAccum = 0.0f;
+	int stride = (width + 15) & ~0x0f;
+	int rowSize = stride * (2 + numMaps * 3);
+	int startY, endY, x, y, i;
+
+	for (i = 0; i < numMaps; i++)
+		Vec3Set(outColor[i], 0.0f, 0.0f, 0.0f);
+
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+	{
+		*outWeightAccum = 0.0f;
+		return;
+	}
+
+	for (y = startY; y < endY; y++)
+	{
+		float *norm = inData + (face * height + y) * rowSize;
+		float NL = vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y + 1.0f) / height) + vN_vE_FaceSpace[2];
+		int startX, endX;
+
+		if (!calcValidColumns(vN_vE_FaceSpace, y, width, height, minNL, &startX, &endX))
+			continue;
+
+		for (x = startX; x < endX; x++)
+		{
+			float nNL = (vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x + 1.0f) / width) + NL) * norm[x];
+			float d = nNL * c1 + c2;
+			float weight = aa / (d * d) * nNL;
+			float *color = norm + x + stride * 2;
+
+			weightAccum += norm[x + stride] * weight;
+			for (i = 0; i < numMaps; i++, color += stride * 3)
+			{
+				outColor[i][0] += color[0] * weight;
+				outColor[i][1] += color[stride] * weight;
+				outColor[i][2] += color[stride * 2] * weight;
+			}
+		}
+	}
+
+	*outWeightAccum = weightAccum;
+}
+
+// same order of adds as the transpose and sum in the planar kernels
+static inline AVX2FUNC float sumLanesAVX2(__m256 value_8)
+{
+	ALIGN16 float lanes[4];
+
+	_mm_store_ps(lanes, _mm_add_ps(_mm256_castps256_ps128(value_8), _mm256_extractf128_ps(value_8, 1)));
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+AVX2FUNC void convolveFaceToVectorBatchAVX2(float outColor[][3], float *outWeightAccum, float *vN_vE_FaceSpace, float *inData, int numMaps, int face, int width, int height, float roughness, float minNL)
+{
+	__m256 color_8[BATCH_MAX * 3];
+	__m256 weightAccum_8 = _mm256_setzero_ps();
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	int i;
+
+	for (i = 0; i < numMaps * 3; i++)
+		color_8[i] = _mm256_setzero_ps();
+
+	// delta for NL per coordinate increment
+	float deltaNL_perX = vN_vE_FaceSpace[0] * 2.0f / width;
+	float deltaNL_perY = vN_vE_FaceSpace[1] * 2.0f / height;
+
+	// value of NL at left side of texture, starts from top and incremented to bottom
+	float baseNL = vN_vE_FaceSpace[0] * (-1.0f + 1.0f / width) + vN_vE_FaceSpace[1] * (-1.0f + 1.0f / height) + vN_vE_FaceSpace[2];
+
+	// determine valid Y range
+	// bail out if none
+	int startY, endY;
+	if (!calcValidRows(vN_vE_FaceSpace, width, height, minNL, &startY, &endY))
+		goto ConvolveFinishBatchAVX2;
+
+	baseNL += deltaNL_perY * startY;
+	float NL;
+
+	int stride = (width + 15) & ~0x0f;
+	int rowSize = stride * (2 + numMaps * 3);
+	float *norm = inData + (face * height + startY) * rowSize;
+
+	// constants to speed up ggx calculation in the main loop
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+
+	__m256 aa_8 = _mm256_set1_ps(aa);
+	__m256 c1_8 = _mm256_set1_ps(c1);
+	__m256 c2_8 = _mm256_set1_ps(c2);
+	__m256 minNL_8 = _mm256_set1_ps(minNL);
+	int conic = conicCulling;
+	__m256 two_8 = _mm256_set1_ps(2.0f);
+	__m256 deltaNL_perX_8 = _mm256_set1_ps(deltaNL_perX);
+	__m256 deltaNL_per8X_8 = _mm256_set1_ps(deltaNL_perX * 8.0f);
+	__m256 laneX_8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	__m256 weight_8[BATCH_RUN / 8];
+
+	int leftY = endY - startY;
+	for (; leftY; leftY--, baseNL += deltaNL_perY, norm += rowSize)
+	{
+		// determine valid X range
+		// skip line if none
+		int startX, endX;
+		if (!calcValidColumns(vN_vE_FaceSpace, endY - leftY, width, height, minNL, &startX, &endX))
+			continue;
+
+		NL = baseNL;
+
+		startX = startX & ~0x07;
+		endX = (endX + 7) & ~0x07;
+
+		NL += deltaNL_perX * startX;
+
+		__m256 NL_8 = _mm256_fmadd_ps(laneX_8, deltaNL_perX_8, _mm256_set1_ps(NL));
+
+		int runX;
+		for (runX = startX; runX < endX; runX += BATCH_RUN)
+		{
+			int numGroups = (MIN(endX - runX, BATCH_RUN)) >> 3;
+			int x, j;
+
+			for (j = 0, x = runX; j < numGroups; j++, x += 8)
+			{
+				__m256 nNL_8 = _mm256_mul_ps(NL_8, _mm256_load_ps(norm + x));
+				nNL_8 = _mm256_and_ps(nNL_8, _mm256_cmp_ps(conic ? nNL_8 : NL_8, minNL_8, _CMP_GT_OQ));
+
+				// aa / (d * d), using a refined reciprocal instead of a divide
+				__m256 ggx_8 = _mm256_fmadd_ps(nNL_8, c1_8, c2_8);
+				ggx_8 = _mm256_mul_ps(ggx_8, ggx_8);
+				__m256 rcp_8 = _mm256_rcp_ps(ggx_8);
+				rcp_8 = _mm256_mul_ps(rcp_8, _mm256_fnmadd_ps(ggx_8, rcp_8, two_8));
+				ggx_8 = _mm256_mul_ps(aa_8, rcp_8);
+
+				weight_8[j] = _mm256_mul_ps(nNL_8, ggx_8);
+				weightAccum_8 = _mm256_fmadd_ps(_mm256_load_ps(norm + x + stride), weight_8[j], weightAccum_8);
+
+				NL_8 = _mm256_add_ps(NL_8, deltaNL_per8X_8);
+			}
+
+			// one cubemap at a time, so its sums stay in registers
+			float *color = norm + runX + stride * 2;
+			for (i = 0; i < numMaps; i++, color += stride * 3)
+			{
+				__m256 red_8 = color_8[i * 3], green_8 = color_8[i * 3 + 1], blue_8 = color_8[i * 3 + 2];
+
+				for (j = 0; j < numGroups; j++)
+				{
+					red_8   = _mm256_fmadd_ps(_mm256_load_ps(color + j * 8),              weight_8[j], red_8);
+					green_8 = _mm256_fmadd_ps(_mm256_load_ps(color + j * 8 + stride),     weight_8[j], green_8);
+					blue_8  = _mm256_fmadd_ps(_mm256_load_ps(color + j * 8 + stride * 2), weight_8[j], blue_8);
+				}
+
+				color_8[i * 3] = red_8;
+				color_8[i * 3 + 1] = green_8;
+				color_8[i * 3 + 2] = blue_8;
+			}
+		}
+	}
+
+ConvolveFinishBatchAVX2:
+	for (i = 0; i < numMaps; i++)
+	{
+		outColor[i][0] = sumLanesAVX2(color_8[i * 3]);
+		outColor[i][1] = sumLanesAVX2(color_8[i * 3 + 1]);
+		outColor[i][2] = sumLanesAVX2(color_8[i * 3 + 2]);
+	}
+	*outWeightAccum = sumLanesAVX2(weightAccum_8);
+}
+
+void (*convolveFaceToVectorBatch)(float[][3], float *, float *, float *, int, int, int, int, float, float) = convolveFaceToVectorBatchScalar;
+
+typedef enum
+{
+	SIMD_NONE,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512
+}
+simdLevel_t;
+
+typedef enum
+{
+	PRECISION_FP32,
+	PRECISION_FP16,
+	PRECISION_INT16
+}
+inputPrecision_t;
+
+void selectConvolutionFuncs(simdLevel_t simd, int planar, inputPrecision_t precision)
+{
+	convolveTileToVector = (simd >= SIMD_AVX2) ? convolveTileToVectorAVX2 : (simd == SIMD_SSE2) ? convolveTileToVectorSSE2 : convolveTileToVectorScalar;
+	convolveWindowToVector = (simd >= SIMD_AVX2) ? convolveWindowToVectorAVX2 : convolveWindowToVectorScalar;
+	convolveFaceToVectorBatch = (simd >= SIMD_AVX2) ? convolveFaceToVectorBatchAVX2 : convolveFaceToVectorBatchScalar;
+
+	if (precision == PRECISION_INT16)
+	{
+		convolveFaceToVector = convolveFaceToVectorAVX2PlanarInt16;
+		convolveFaceToVectors = convolveFaceToVectorsLoop;
+		formatDataForConvolution = formatDataForConvolutionPlanarInt16;
+		return;
+	}
+
+	if (precision == PRECISION_FP16 && simd == SIMD_AVX2)
+	{
+		convolveFaceToVector = convolveFaceToVectorAVX2PlanarFP16;
+		convolveFaceToVectors = convolveFaceToVectorsAVX2PlanarFP16;
+		formatDataForConvolution = formatDataForConvolutionPlanarFP16;
+		return;
+	}
+
+#ifdef GGXCC_AVX512
+	if (precision == PRECISION_FP16 && simd == SIMD_AVX512)
+	{
+		convolveFaceToVector = convolveFaceToVectorAVX512PlanarFP16;
+		convolveFaceToVectors = convolveFaceToVectorsAVX512PlanarFP16;
+		formatDataForConvolution = formatDataForConvolutionPlanarFP16;
+		return;
+	}
+#endif
+
+	switch (simd)
+	{
+		case SIMD_NONE:
+		default:
+			convolveFaceToVector = convolveFaceToVectorScalar;
+			convolveFaceToVectors = convolveFaceToVectorsLoop;
+			formatDataForConvolution = formatDataForConvolutionScalar;
+			break;
+
+		case SIMD_SSE2:
+			convolveFaceToVector = planar ? convolveFaceToVectorSSE2Planar : convolveFaceToVectorSSE2;
+			convolveFaceToVectors = convolveFaceToVectorsLoop;
+			formatDataForConvolution = planar ? formatDataForConvolutionPlanar : formatDataForConvolutionSSE2;
+			break;
+
+		case SIMD_AVX2:
+			convolveFaceToVector = planar ? convolveFaceToVectorAVX2Planar : convolveFaceToVectorAVX2;
+			convolveFaceToVectors = planar ? convolveFaceToVectorsAVX2Planar : convolveFaceToVectorsLoop;
+			formatDataForConvolution = planar ? formatDataForConvolutionPlanar : formatDataForConvolutionAVX2;
+			break;
+
+#ifdef GGXCC_AVX512
+		case SIMD_AVX512:
+			convolveFaceToVector = planar ? convolveFaceToVectorAVX512Planar : convolveFaceToVectorAVX512;
+			convolveFaceToVectors = planar ? convolveFaceToVectorsAVX512Planar : convolveFaceToVectorsLoop;
+			formatDataForConvolution = planar ? formatDataForConvolutionPlanar : formatDataForConvolutionAVX512;
+			break;
+#endif
+	}
+}
+
+// find face, mip, x, and y of a pixel in the output data
+void decodeOutPixel(int outRes, int outPixelCount, int *outFace, int *outMipNum, int *outMipRes, int *outX, int *outY)
+{
+	int mipRes;
+	
+	mipRes = outRes;
+	int outNumFacePixels = 0;
+	while(mipRes)
+	{
+		outNumFacePixels += mipRes * mipRes;
+		mipRes >>= 1;
+	}
+	
+	*outFace = outPixelCount / outNumFacePixels;
+	outPixelCount -= *outFace * outNumFacePixels;
+
+	mipRes = outRes;
+	*outMipNum = 0;
+	while (outPixelCount >= mipRes * mipRes)
+	{
+		outPixelCount -= mipRes * mipRes;
+		mipRes >>= 1;
+		(*outMipNum)++;
+	}
+	
+	*outMipRes = mipRes;
+	*outY = outPixelCount / mipRes;
+	*outX = outPixelCount - *outY * mipRes;
+}
+
+int encodeOutPixel(int outRes, int outFace, int outMipNum, int outX, int outY)
+{
+	int mipRes;
+
+	mipRes = outRes;
+	int outNumFacePixels = 0;
+	while(mipRes)
+	{
+		outNumFacePixels += mipRes * mipRes;
+		mipRes >>= 1;
+	}
+
+	int outPixelCount = outFace * outNumFacePixels;
+
+	mipRes = outRes;
+	for (; outMipNum; outMipNum--, mipRes >>= 1)
+		outPixelCount += mipRes * mipRes;
+
+	return outPixelCount + outY * mipRes + outX;
+}
+
+// size of the per output mip tables, enough for 32768 texel faces
+#define OUTPUT_MIPS_MAX 16
+
+float calcRoughness(int outMipNum, int outNumMips)
+{
+	// first mip is min roughness
+	// last three mips are roughness 1 (~diffuse)
+	// only 4x4 (third last mip) should be used in engine
+	// with three mips or less, a face of 7 or less, all are roughness 1
+	if (outNumMips <= 3)
+		return 1.0f;
+
+	float roughness = outMipNum / (float)(outNumMips - 3);
+	float minRoughness = 0.5f / (float)(outNumMips - 3);
+	return CLAMP(roughness, minRoughness, 1.0f);
+}
+
+// Instead of simulated samples, the cutoff can be set by the fraction of the
+// lobe's energy it drops.  With t = nNL the lobe is D(t) * t = aa * t / (c1 * t + c2)^2
+// per 2pi dt, which integrates to aa * (ln(c1 * t + c2) + c2 / (c1 * t + c2)) / c1^2,
+// so minNL is found by bisecting the CDF.  The cutoffs are solved once per mip.
+
+#define LOBE_CUTOFFS_MAX 16
+
+float lobeEnergyCutoff = 0.0f;
+int numLobeCutoffs = 0;
+float lobeCutoffRoughness[LOBE_CUTOFFS_MAX];
+float lobeCutoffNL[LOBE_CUTOFFS_MAX];
+
+// integral of the lobe from 0 to t, without the constant aa
+double calcLobeEnergy(double t, double aa)
+{
+	double c1 = 0.5 * aa - 0.5;
+	double c2 = c1 + 1.0;
+
+	// nearly a clamped cosine, where the closed form cancels
+	if (fabs(c1) < 1e-4)
+		return 0.5 * t * t / (c2 * c2);
+
+	return (log((c1 * t + c2) / c2) + c2 / (c1 * t + c2) - 1.0) / (c1 * c1);
+}
+
+// minNL where the lobe below it holds fraction of its energy
+float calcMinNLForEnergy(float roughness, float fraction)
+{
+	double alpha = roughness * roughness;
+	double aa = alpha * alpha;
+	double total = calcLobeEnergy(1.0, aa);
+	double lo = 0.0, hi = 1.0;
+	int i;
+
+	for (i = 0; i < 60; i++)
+	{
+		double mid = 0.5 * (lo + hi);
+		if (calcLobeEnergy(mid, aa) < fraction * total)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// solve and report the cutoff of each mip
+void buildLobeCutoffs(int outNumMips)
+{
+	int i;
+
+	printf("Dropping at most %g of each lobe's energy, so outputs are off by at most\n", lobeEnergyCutoff);
+	printf("that fraction of the linear range of the input within the lobe.  Cutoffs:\n");
+
+	for (i = 0; i < outNumMips && i < LOBE_CUTOFFS_MAX; i++)
+	{
+		lobeCutoffRoughness[i] = calcRoughness(i, outNumMips);
+		lobeCutoffNL[i] = calcMinNLForEnergy(lobeCutoffRoughness[i], lobeEnergyCutoff);
+		printf("  mip %2d, roughness %.3f: minNL %.4f\n", i, lobeCutoffRoughness[i], lobeCutoffNL[i]);
+	}
+
+	numLobeCutoffs = i;
+}
+
+// use importance sampling equation to use smaller area
+float calcMinNL(float roughness, int simSamples)
+{
+	float minNL = 0.0f;
+	int i;
+
+	if (lobeEnergyCutoff)
+	{
+		for (i = 0; i < numLobeCutoffs; i++)
+			if (lobeCutoffRoughness[i] == roughness)
+				return lobeCutoffNL[i];
+
+		return calcMinNLForEnergy(roughness, lobeEnergyCutoff);
+	}
+
+	if (simSamples)
+	{
+		float alpha = roughness * roughness;
+		float aa = alpha * alpha;
+		float lastSample = (float)simSamples / (float)(simSamples + 1);
+		minNL = sqrt((1.0 - lastSample)/((aa - 1.0f) * lastSample + 1.0f));
+	}
+	return minNL;
+}
+
+// transform vN_vE to face space
+void transformToFaceSpace(float vN_vE_FaceSpace[4], float vN_vE[4], int inFace)
+{
+	int inAxis = inFace / 2;
+	int inAxisNeg = inFace & 1;
+
+	vN_vE_FaceSpace[0] = (inAxis == 0) ? (inAxisNeg ? vN_vE[2] : -vN_vE[2]) : ((inFace == 5) ? -vN_vE[0] : vN_vE[0]);
+	vN_vE_FaceSpace[1] = (inAxis == 1) ? (inAxisNeg ? -vN_vE[2] : vN_vE[2]) : -vN_vE[1];
+	vN_vE_FaceSpace[2] = inAxisNeg ? -vN_vE[inAxis] : vN_vE[inAxis];
+}
+
+// weight of the GGX lobe at nNL, D(nNL) * nNL
+static inline float calcGgxWeight(float nNL, float aa, float c1, float c2)
+{
+	if (nNL <= 0.0f)
+		return 0.0f;
+
+	float d = nNL * c1 + c2;
+	return aa / (d * d) * nNL;
+}
+
+// Convolve one tile against a vector, or use its aggregate if the weight varies
+// by no more than threshold over it.  Coarse tiles are split into fine ones.
+void convolveTileTree(float rgbw[4], float vN_vE_FaceSpace[4], float *inDataFP32, int face, int width, int height, int coarse, int tx, int ty, float aa, float threshold)
+{
+	const tile_t *tile = coarse ? &coarseTiles[(face * groupsY + ty) * groupsX + tx] : &fineTiles[(face * tilesY + ty) * tilesX + tx];
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	int i;
+
+	// nNL over the tile is within the angle to its center, plus or minus its cone
+	float cosCenter = DotProduct(vN_vE_FaceSpace, tile->dir);
+	float sinCenter = sqrtf(MAX(1.0f - cosCenter * cosCenter, 0.0f));
+	float maxNL = (cosCenter >= tile->cosAngle) ? 1.0f : cosCenter * tile->cosAngle + sinCenter * tile->sinAngle;
+	float minNL = cosCenter * tile->cosAngle - sinCenter * tile->sinAngle;
+
+	float spread = (calcGgxWeight(maxNL, aa, c1, c2) - calcGgxWeight(minNL, aa, c1, c2)) * tile->rgbw[3];
+	if (spread <= threshold)
+	{
+		float weight = calcGgxWeight(cosCenter, aa, c1, c2);
+		for (i = 0; i < 4; i++)
+			rgbw[i] += tile->rgbw[i] * weight;
+	}
+	else if (coarse)
+	{
+		int x, y;
+		for (y = ty * TILE_GROUP; y < MIN((ty + 1) * TILE_GROUP, tilesY); y++)
+			for (x = tx * TILE_GROUP; x < MIN((tx + 1) * TILE_GROUP, tilesX); x++)
+				convolveTileTree(rgbw, vN_vE_FaceSpace, inDataFP32, face, width, height, 0, x, y, aa, threshold);
+	}
+	else
+	{
+		convolveTileToVector(rgbw, vN_vE_FaceSpace, inDataFP32, face, width, height, tx * TILE_SIZE, ty * TILE_SIZE, MIN((ty + 1) * TILE_SIZE, height), aa);
+	}
+}
+
+// convolve a vector with hierarchical tile culling, over all faces at once
+// since the threshold is relative to the total weight of the lobe
+void convolveCubemapToVectorTiled(float outColor[3], float *outWeightAccum, float vN_vE[4], float *inDataFP32, int width, int height, float roughness)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	float vN_vE_FaceSpace[6][4];
+	float rgbw[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	int face, tx, ty;
+
+	// lower bound of the total weight, from the least weight of each coarse tile,
+	// or the texel nearest the lobe center, approximating its solid angle
+	float peakWeight = 0.5f * aa * 4.0f / (width * height);
+	float totalWeight = 0.0f;
+
+	for (face = 0; face < 6; face++)
+	{
+		transformToFaceSpace(vN_vE_FaceSpace[face], vN_vE, face);
+
+		for (ty = 0; ty < groupsY; ty++)
+		{
+			for (tx = 0; tx < groupsX; tx++)
+			{
+				const tile_t *tile = &coarseTiles[(face * groupsY + ty) * groupsX + tx];
+				float cosCenter = DotProduct(vN_vE_FaceSpace[face], tile->dir);
+				float sinCenter = sqrtf(MAX(1.0f - cosCenter * cosCenter, 0.0f));
+				float minNL = cosCenter * tile->cosAngle - sinCenter * tile->sinAngle;
+
+				totalWeight += calcGgxWeight(minNL, aa, c1, c2) * tile->rgbw[3];
+			}
+		}
+	}
+
+	totalWeight = MAX(totalWeight, peakWeight * calcPeakWeight(vN_vE_FaceSpace[0], width, c1, c2));
+
+	for (face = 0; face < 6; face++)
+		for (ty = 0; ty < groupsY; ty++)
+			for (tx = 0; tx < groupsX; tx++)
+				convolveTileTree(rgbw, vN_vE_FaceSpace[face], inDataFP32, face, width, height, 1, tx, ty, aa, tileEpsilon * totalWeight);
+
+	Vec3Set(outColor, rgbw[0], rgbw[1], rgbw[2]);
+	*outWeightAccum = rgbw[3];
+}
+
+// ***************************************************************************
+// Mip plans
+//
+// Everything the per pixel loops need that only depends on the output mip is
+// worked out once before the threads start: the lobe constants and cutoff,
+// the input level to read, the warped coordinates of the mip's texel centers,
+// and which input faces its lobes can reach.  Output texel centers are within
+// the cone of their face, so texels on the opposite face have nNL < 1 / 3 and
+// NL < 1 / sqrt(3), and past that cutoff the opposite face is skipped.
+
+#define MIP_PLANS_MAX OUTPUT_MIPS_MAX
+
+typedef struct
+{
+	int mipRes;
+	float roughness, aa, c1, c2, minNL;
+	int sourceLevel;		// -1 for the input itself
+	float *texCoords;		// warped, same for rows and columns
+	const float *solidAngles;
+	int numFaces[6];
+	int faces[6][6];		// input faces the lobes of each output face reach
+}
+mipPlan_t;
+
+mipPlan_t mipPlans[MIP_PLANS_MAX];
+int numMipPlans = 0;
+
+void buildMipPlans(int outRes, int outNumMips, int simSamples)
+{
+	int mip, face, i;
+
+	if (outNumMips > MIP_PLANS_MAX)
+	{
+		printf("Error! Too many mips to plan.\n");
+		exit(1);
+	}
+
+	for (mip = 0; mip < outNumMips; mip++)
+	{
+		mipPlan_t *plan = &mipPlans[mip];
+		int mipRes = outRes >> mip;
+		float warp = calcWarp(mipRes);
+		float alpha;
+
+		plan->mipRes = mipRes;
+		plan->roughness = calcRoughness(mip, outNumMips);
+		alpha = plan->roughness * plan->roughness;
+		plan->aa = alpha * alpha;
+		plan->c1 = 0.5f * plan->aa - 0.5f;
+		plan->c2 = plan->c1 + 1.0f;
+		plan->minNL = calcMinNL(plan->roughness, simSamples);
+		plan->sourceLevel = -1;
+
+		plan->texCoords = malloc(mipRes * sizeof(*plan->texCoords));
+		for (i = 0; i < mipRes; i++)
+			plan->texCoords[i] = convertNativeCoordToTexCoord(i, mipRes, warp);
+		plan->solidAngles = getGeometryTable(mipRes)->solidAngles;
+
+		int skipOpposite = plan->minNL >= (conicCulling ? 1.0f / 3.0f : 0.5773503f);
+
+		for (face = 0; face < 6; face++)
+		{
+			plan->numFaces[face] = 0;
+			for (i = 0; i < 6; i++)
+				if (!skipOpposite || i != (face ^ 1))
+					plan->faces[face][plan->numFaces[face]++] = i;
+		}
+	}
+
+	numMipPlans = outNumMips;
+}
+
+// once the source levels are built
+void selectPlanSourceLevels(void)
+{
+	int mip;
+
+	for (mip = 0; mip < numMipPlans; mip++)
+		mipPlans[mip].sourceLevel = calcSourceLevel(mipPlans[mip].roughness);
+}
+
+static inline void getPlanSource(const mipPlan_t *plan, float **inDataFP32, int *width, int *height)
+{
+	if (plan->sourceLevel < 0)
+		return;
+
+	*inDataFP32 = sourceLevelData[plan->sourceLevel];
+	*width = *height = sourceLevelRes[plan->sourceLevel];
+}
+
+// same as genNorm, from the plan's coordinates
+static inline void genPlanNorm(float norm[4], const mipPlan_t *plan, int x, int y, int face)
+{
+	float st[2];
+
+	st[0] = plan->texCoords[x];
+	st[1] = plan->texCoords[y];
+
+	MapCubeToVec3(norm, st, face);
+	Vec3Normalize(norm);
+
+	norm[3] = plan->solidAngles[y * plan->mipRes + x];
+}
+
+// ***************************************************************************
+// Importance sampled engine
+//
+// Instead of weighting every texel in the lobe, sample a fixed Hammersley set
+// of half vectors from the GGX distribution, and look up each reflected L
+// bilinearly from an input level matched to the solid angle the sample stands
+// for, 1 / (numSamples * pdf).  This is filtered importance sampling, and its
+// cost depends only on the number of samples.
+//
+// Since vN == vE, pdf(L) = D(NH) / 4 and the estimate of the convolution is
+// sum(color * NL) / sum(NL).  Levels are stored as linear RGB with a border of
+// one texel copied from the neighbouring faces, so lookups are seam aware
+// without any special cases.
+
+#define SAMPLE_LEVELS_MAX 16
+
+typedef struct sampleSet_s
+{
+	int numSamples;
+	float (*samples)[4];	// L in tangent space, so NL is samples[i][2], and source level
+}
+sampleSet_t;
+
+int importanceSamples = 0;
+int numSampleLevels = 0;
+float *sampleLevelData[SAMPLE_LEVELS_MAX];
+int sampleLevelRes[SAMPLE_LEVELS_MAX];
+sampleSet_t sampleSets[SAMPLE_LEVELS_MAX];
+
+float radicalInverse(uint32_t bits)
+{
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x55555555) << 1) | ((bits & 0xaaaaaaaa) >> 1);
+	bits = ((bits & 0x33333333) << 2) | ((bits & 0xcccccccc) >> 2);
+	bits = ((bits & 0x0f0f0f0f) << 4) | ((bits & 0xf0f0f0f0) >> 4);
+	bits = ((bits & 0x00ff00ff) << 8) | ((bits & 0xff00ff00) >> 8);
+	return bits * 2.3283064365386963e-10f;
+}
+
+// inverse of transformToFaceSpace
+void transformFromFaceSpace(float vN_vE[4], float vN_vE_FaceSpace[4], int inFace)
+{
+	int inAxis = inFace / 2;
+	int inAxisNeg = inFace & 1;
+	float w = inAxisNeg ? -vN_vE_FaceSpace[2] : vN_vE_FaceSpace[2];
+
+	if (inAxis == 0)
+		Vec3Set(vN_vE, w, -vN_vE_FaceSpace[1], inAxisNeg ? vN_vE_FaceSpace[0] : -vN_vE_FaceSpace[0]);
+	else if (inAxis == 1)
+		Vec3Set(vN_vE, vN_vE_FaceSpace[0], w, inAxisNeg ? -vN_vE_FaceSpace[1] : vN_vE_FaceSpace[1]);
+	else
+		Vec3Set(vN_vE, (inFace == 5) ? -vN_vE_FaceSpace[0] : vN_vE_FaceSpace[0], -vN_vE_FaceSpace[1], w);
+}
+
+// face a direction points into, and the direction in that face's space
+static inline int calcFaceSpace(float vN_vE_FaceSpace[4], float vN_vE[4])
+{
+	float ax = fabsf(vN_vE[0]), ay = fabsf(vN_vE[1]), az = fabsf(vN_vE[2]);
+	int face;
+
+	if (ax >= ay && ax >= az)
+		face = vN_vE[0] < 0.0f;
+	else if (ay >= az)
+		face = 2 + (vN_vE[1] < 0.0f);
+	else
+		face = 4 + (vN_vE[2] < 0.0f);
+
+	transformToFaceSpace(vN_vE_FaceSpace, vN_vE, face);
+	return face;
+}
+
+float *formatDataForSampling(uint8_t *rgba8, int inRes)
+{
+	int face, y, x;
+	int stride = inRes + 2;
+	float *outData = malloc(stride * stride * 3 * 6 * sizeof(*outData));
+
+	for (face = 0; face < 6; face++)
+	{
+		float *outPixel = outData + face * stride * stride * 3;
+
+		for (y = -1; y <= inRes; y++)
+		{
+			for (x = -1; x <= inRes; x++, outPixel += 3)
+			{
+				int inFace = face, inX = x, inY = y;
+
+				// border texels come from the nearest texel of the neighbouring face
+				if (x < 0 || y < 0 || x >= inRes || y >= inRes)
+				{
+					float vN_vE[4], vN_vE_FaceSpace[4];
+
+					vN_vE_FaceSpace[0] = -1.0f + (2.0f * x + 1.0f) / inRes;
+					vN_vE_FaceSpace[1] = -1.0f + (2.0f * y + 1.0f) / inRes;
+					vN_vE_FaceSpace[2] = 1.0f;
+					transformFromFaceSpace(vN_vE, vN_vE_FaceSpace, face);
+
+					inFace = calcFaceSpace(vN_vE_FaceSpace, vN_vE);
+					inX = (int)floorf((vN_vE_FaceSpace[0] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * inRes);
+					inY = (int)floorf((vN_vE_FaceSpace[1] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * inRes);
+					inX = CLAMP(inX, 0, inRes - 1);
+					inY = CLAMP(inY, 0, inRes - 1);
+				}
+
+				uint8_t *inPixel = rgba8 + ((inFace * inRes + inY) * inRes + inX) * 4;
+				outPixel[0] = ryg_srgb8_to_float(inPixel[0]);
+				outPixel[1] = ryg_srgb8_to_float(inPixel[1]);
+				outPixel[2] = ryg_srgb8_to_float(inPixel[2]);
+			}
+		}
+	}
+
+	return outData;
+}
+
+// levels down to 1x1, from the mips in the input file where present
+void buildSampleLevels(uint8_t *inData, int inRes, int inNumMips)
+{
+	uint8_t *levelData = extractInputLevel(inData, inRes, inNumMips, 0);
+
+	numSampleLevels = 0;
+	for (;;)
+	{
+		int levelRes = inRes >> numSampleLevels;
+
+		sampleLevelRes[numSampleLevels] = levelRes;
+		sampleLevelData[numSampleLevels] = formatDataForSampling(levelData, levelRes);
+		numSampleLevels++;
+
+		if (levelRes == 1 || numSampleLevels == SAMPLE_LEVELS_MAX)
+			break;
+
+		uint8_t *nextData;
+		if (numSampleLevels < inNumMips)
+			nextData = extractInputLevel(inData, inRes, inNumMips, numSampleLevels);
+		else
+			nextData = downsampleInputLevel(levelData, levelRes);
+
+		free(levelData);
+		levelData = nextData;
+	}
+
+	free(levelData);
+}
+
+void buildSampleSet(sampleSet_t *set, float roughness, int numSamples, int inRes)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	float texelSolidAngle = 4.0f * 3.14159265f / (6.0f * inRes * inRes);
+	int i;
+
+	set->samples = malloc(numSamples * sizeof(*set->samples));
+	set->numSamples = 0;
+
+	for (i = 0; i < numSamples; i++)
+	{
+		float e1 = (float)i / numSamples;
+		float phi = 2.0f * 3.14159265f * radicalInverse(i);
+
+		float NHNH = (1.0f - e1) / ((aa - 1.0f) * e1 + 1.0f);
+		float NH = sqrtf(NHNH);
+		float NL = 2.0f * NHNH - 1.0f;
+
+		if (NL <= 0.0f)
+			continue;
+
+		// L = 2 * NH * H - N, with vN == vE
+		float sinL = 2.0f * NH * sqrtf(1.0f - NHNH);
+		float d = NHNH * (aa - 1.0f) + 1.0f;
+		float pdf = aa / (3.14159265f * d * d) * 0.25f;
+		float sampleSolidAngle = 1.0f / (numSamples * pdf);
+
+		float *sample = set->samples[set->numSamples++];
+		sample[0] = sinL * cosf(phi);
+		sample[1] = sinL * sinf(phi);
+		sample[2] = NL;
+		sample[3] = CLAMP(0.5f * log2f(sampleSolidAngle / texelSolidAngle) + 1.0f, 0.0f, numSampleLevels - 1.0f);
+	}
+}
+
+// bilinear lookup in one level
+static inline void sampleLevel(float color[3], int level, float vN_vE[4])
+{
+	float vN_vE_FaceSpace[4];
+	int res = sampleLevelRes[level];
+	int stride = res + 2;
+	int face = calcFaceSpace(vN_vE_FaceSpace, vN_vE);
+
+	// position in texels, from the first texel of the border
+	float s = (vN_vE_FaceSpace[0] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * res + 0.5f;
+	float t = (vN_vE_FaceSpace[1] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * res + 0.5f;
+	int x = CLAMP((int)s, 0, res);
+	int y = CLAMP((int)t, 0, res);
+	float fx = CLAMP(s - x, 0.0f, 1.0f);
+	float fy = CLAMP(t - y, 0.0f, 1.0f);
+
+	float *texel = sampleLevelData[level] + ((face * stride + y) * stride + x) * 3;
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		float top = texel[i] + (texel[i + 3] - texel[i]) * fx;
+		float bottom = texel[i + stride * 3] + (texel[i + stride * 3 + 3] - texel[i + stride * 3]) * fx;
+		color[i] = top + (bottom - top) * fy;
+	}
+}
+
+void convolveCubemapToVectorSampled(float outColor[3], float *outWeightAccum, float vN_vE[4], int outMipNum)
+{
+	const sampleSet_t *set = &sampleSets[outMipNum];
+	float tangent[3], bitangent[3];
+	float color[3] = {0.0f, 0.0f, 0.0f}, weightAccum = 0.0f;
+	int i;
+
+	// any frame around N will do
+	if (fabsf(vN_vE[2]) < 0.999f)
+		Vec3Set(tangent, -vN_vE[1], vN_vE[0], 0.0f);
+	else
+		Vec3Set(tangent, 0.0f, -vN_vE[2], vN_vE[1]);
+	Vec3Normalize(tangent);
+	Vec3Set(bitangent, vN_vE[1] * tangent[2] - vN_vE[2] * tangent[1], vN_vE[2] * tangent[0] - vN_vE[0] * tangent[2], vN_vE[0] * tangent[1] - vN_vE[1] * tangent[0]);
+
+	for (i = 0; i < set->numSamples; i++)
+	{
+		const float *sample = set->samples[i];
+		float vL[4], sampleColor[3], nextColor[3];
+
+		vL[0] = tangent[0] * sample[0] + bitangent[0] * sample[1] + vN_vE[0] * sample[2];
+		vL[1] = tangent[1] * sample[0] + bitangent[1] * sample[1] + vN_vE[1] * sample[2];
+		vL[2] = tangent[2] * sample[0] + bitangent[2] * sample[1] + vN_vE[2] * sample[2];
+
+		// trilinear between levels
+		int level = (int)sample[3];
+		float frac = sample[3] - level;
+
+		sampleLevel(sampleColor, level, vL);
+		if (frac > 0.0f)
+		{
+			sampleLevel(nextColor, level + 1, vL);
+			sampleColor[0] += (nextColor[0] - sampleColor[0]) * frac;
+			sampleColor[1] += (nextColor[1] - sampleColor[1]) * frac;
+			sampleColor[2] += (nextColor[2] - sampleColor[2]) * frac;
+		}
+
+		color[0] += sampleColor[0] * sample[2];
+		color[1] += sampleColor[1] * sample[2];
+		color[2] += sampleColor[2] * sample[2];
+		weightAccum += sample[2];
+	}
+
+	Vec3Set(outColor, color[0], color[1], color[2]);
+	*outWeightAccum = weightAccum;
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Spherical harmonic engine
+//
+// With vN == vE the lobe only depends on the angle between N and L, so by
+// Funk-Hecke convolving with it scales each SH band l of the input by
+// k_l = 2pi * integral(D(t) * t * P_l(t), minNL..1), and the normalized
+// result is sum(k_l / k_0 * c_lm * Y_lm(N)).  The input is projected once,
+// and mips whose lobe is wide enough that band shOrder + 1 keeps less than
+// SH_TRUNCATION of the weight are reconstructed from it, in time independent
+// of the input resolution.  Other mips use the other engines.
+
+#define SH_ORDER_MAX 16
+#define SH_TRUNCATION 0.02f
+#define SH_ZONAL_STEPS 65536
+
+int shOrder = 0;
+float shNorm[SH_ORDER_MAX + 1][SH_ORDER_MAX + 1];
+float (*shCoeffs)[3];
+float shZonal[OUTPUT_MIPS_MAX][SH_ORDER_MAX + 1];
+int shMipEnabled[OUTPUT_MIPS_MAX];
+
+void initSHNorm(int order)
+{
+	int l, m, i;
+
+	for (l = 0; l <= order; l++)
+	{
+		for (m = 0; m <= l; m++)
+		{
+			// sqrt((2l + 1) / 4pi * (l - m)! / (l + m)!)
+			double norm = (2.0 * l + 1.0) / (4.0 * 3.14159265358979);
+			for (i = l - m + 1; i <= l + m; i++)
+				norm /= i;
+			shNorm[l][m] = sqrt(norm);
+		}
+	}
+}
+
+// real SH basis up to order, indexed by l * (l + 1) + m
+void evalSH(float *outY, int order, float dir[3])
+{
+	float P[SH_ORDER_MAX + 1][SH_ORDER_MAX + 1];
+	float z = CLAMP(dir[2], -1.0f, 1.0f);
+	float sinTheta = sqrtf(MAX(1.0f - z * z, 0.0f));
+	float phi = atan2f(dir[1], dir[0]);
+	int l, m;
+
+	// associated Legendre polynomials, by the usual recurrences
+	P[0][0] = 1.0f;
+	for (m = 0; m <= order; m++)
+	{
+		if (m > 0)
+			P[m][m] = -(2.0f * m - 1.0f) * sinTheta * P[m - 1][m - 1];
+		if (m < order)
+			P[m + 1][m] = z * (2.0f * m + 1.0f) * P[m][m];
+		for (l = m + 2; l <= order; l++)
+			P[l][m] = (z * (2.0f * l - 1.0f) * P[l - 1][m] - (l + m - 1.0f) * P[l - 2][m]) / (l - m);
+	}
+
+	for (l = 0; l <= order; l++)
+	{
+		outY[l * (l + 1)] = shNorm[l][0] * P[l][0];
+		for (m = 1; m <= l; m++)
+		{
+			outY[l * (l + 1) + m] = 1.4142136f * shNorm[l][m] * cosf(m * phi) * P[l][m];
+			outY[l * (l + 1) - m] = 1.4142136f * shNorm[l][m] * sinf(m * phi) * P[l][m];
+		}
+	}
+}
+
+// k_l / k_0 for a lobe, by the midpoint rule over t = NL
+void calcZonalCoeffs(float *outZonal, int order, float roughness, float minNL)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	float c1 = 0.5f * aa - 0.5f;
+	float c2 = c1 + 1.0f;
+	double zonal[SH_ORDER_MAX + 2] = {0.0};
+	float step = (1.0f - MAX(minNL, 0.0f)) / SH_ZONAL_STEPS;
+	int i, l;
+
+	for (i = 0; i < SH_ZONAL_STEPS; i++)
+	{
+		float t = MAX(minNL, 0.0f) + (i + 0.5f) * step;
+		float d = t * c1 + c2;
+		float weight = aa / (d * d) * t;
+		float p0 = 1.0f, p1 = t;
+
+		zonal[0] += weight;
+		for (l = 1; l <= order; l++)
+		{
+			float p2 = ((2.0f * l + 1.0f) * t * p1 - l * p0) / (l + 1.0f);
+			zonal[l] += weight * p1;
+			p0 = p1;
+			p1 = p2;
+		}
+	}
+
+	for (l = 0; l <= order; l++)
+		outZonal[l] = zonal[l] / zonal[0];
+}
+
+// project the full input, and pick the mips to reconstruct
+void buildSHProjection(uint8_t *inData, int inRes, int inNumMips, int outNumMips, int simSamples)
+{
+	int numCoeffs = (shOrder + 1) * (shOrder + 1);
+	uint8_t *levelData = extractInputLevel(inData, inRes, inNumMips, 0);
+	float *levelFP32 = formatDataForConvolutionScalar(levelData, inRes);
+	float *inPixel = levelFP32;
+	float Y[(SH_ORDER_MAX + 1) * (SH_ORDER_MAX + 1)];
+	double (*coeffs)[3] = calloc(numCoeffs, sizeof(*coeffs));
+	int face, x, y, i, numEnabled = 0;
+
+	initSHNorm(shOrder);
+
+	for (face = 0; face < 6; face++)
+	{
+		for (y = 0; y < inRes; y++)
+		{
+			for (x = 0; x < inRes; x++, inPixel += 5)
+			{
+				float vN_vE[4], vN_vE_FaceSpace[4];
+				float solidAngle = inPixel[1];
+
+				vN_vE_FaceSpace[0] = -1.0f + (2.0f * x + 1.0f) / inRes;
+				vN_vE_FaceSpace[1] = -1.0f + (2.0f * y + 1.0f) / inRes;
+				vN_vE_FaceSpace[2] = 1.0f;
+				transformFromFaceSpace(vN_vE, vN_vE_FaceSpace, face);
+				Vec3Normalize(vN_vE);
+
+				evalSH(Y, shOrder, vN_vE);
+				for (i = 0; i < numCoeffs; i++)
+				{
+					float weight = Y[i] * solidAngle;
+					coeffs[i][0] += inPixel[2] * weight;
+					coeffs[i][1] += inPixel[3] * weight;
+					coeffs[i][2] += inPixel[4] * weight;
+				}
+			}
+		}
+	}
+
+	shCoeffs = malloc(numCoeffs * sizeof(*shCoeffs));
+	for (i = 0; i < numCoeffs; i++)
+		Vec3Set(shCoeffs[i], coeffs[i][0], coeffs[i][1], coeffs[i][2]);
+
+	for (i = 0; i < outNumMips; i++)
+	{
+		float roughness = calcRoughness(i, outNumMips);
+		float zonal[SH_ORDER_MAX + 2];
+
+		calcZonalCoeffs(zonal, shOrder + 1, roughness, calcMinNL(roughness, simSamples));
+		memcpy(shZonal[i], zonal, (shOrder + 1) * sizeof(*zonal));
+
+		shMipEnabled[i] = fabsf(zonal[shOrder + 1]) < SH_TRUNCATION;
+		numEnabled += shMipEnabled[i];
+	}
+
+	free(coeffs);
+	free(levelFP32);
+	free(levelData);
+
+	printf("Reconstructing %d of %d mips from order %d spherical harmonics.\n", numEnabled, outNumMips, shOrder);
+}
+
+void convolveCubemapToVectorSH(float outColor[3], float *outWeightAccum, float vN_vE[4], int outMipNum)
+{
+	float Y[(SH_ORDER_MAX + 1) * (SH_ORDER_MAX + 1)];
+	float color[3] = {0.0f, 0.0f, 0.0f};
+	int l, i;
+
+	evalSH(Y, shOrder, vN_vE);
+
+	for (l = 0, i = 0; l <= shOrder; l++)
+	{
+		for (; i < (l + 1) * (l + 1); i++)
+		{
+			float weight = shZonal[outMipNum][l] * Y[i];
+			color[0] += shCoeffs[i][0] * weight;
+			color[1] += shCoeffs[i][1] * weight;
+			color[2] += shCoeffs[i][2] * weight;
+		}
+	}
+
+	// ringing can go below 0
+	Vec3Set(outColor, MAX(color[0], 0.0f), MAX(color[1], 0.0f), MAX(color[2], 0.0f));
+	*outWeightAccum = 1.0f;
+}
+
+// The last three mips all have roughness 1, and their lobe is smooth enough
+// that low order SH fitted to the first of them reproduces it.  So only that
+// mip is convolved, and the two after it are evaluated from the fit.  Order 2
+// would hold a clamped cosine, but the 8 bit results fit better with order 4.
+
+#define ROUGH_FIT_ORDER 4
+#define ROUGH_FIT_COEFFS ((ROUGH_FIT_ORDER + 1) * (ROUGH_FIT_ORDER + 1))
+
+int reuseRoughMips = 1;
+
+static inline int isDerivedMip(int outMipNum, int outNumMips)
+{
+	return reuseRoughMips && outNumMips > 3 && outMipNum >= outNumMips - 2;
+}
+
+// fit by least squares weighted by solid angle, since 4x4 texels don't integrate SH exactly
+void deriveRoughMips(uint8_t *outData, int outRes, int outNumMips)
+{
+	double AtA[ROUGH_FIT_COEFFS][ROUGH_FIT_COEFFS] = {{0.0}}, Atb[ROUGH_FIT_COEFFS][3] = {{0.0}};
+	float Y[ROUGH_FIT_COEFFS], coeffs[ROUGH_FIT_COEFFS][3];
+	int srcMip = outNumMips - 3;
+	int srcRes = outRes >> srcMip;
+	int face, mip, x, y, i, j, k;
+
+	initSHNorm(ROUGH_FIT_ORDER);
+
+	for (face = 0; face < 6; face++)
+	{
+		for (y = 0; y < srcRes; y++)
+		{
+			for (x = 0; x < srcRes; x++)
+			{
+				uint8_t *pixel = outData + encodeOutPixel(outRes, face, srcMip, x, y) * 4;
+				float vN_vE[4];
+
+				genNorm(vN_vE, x, y, face, srcRes, calcWarp(srcRes));
+				evalSH(Y, ROUGH_FIT_ORDER, vN_vE);
+
+				for (i = 0; i < ROUGH_FIT_COEFFS; i++)
+				{
+					for (j = 0; j < ROUGH_FIT_COEFFS; j++)
+						AtA[i][j] += Y[i] * Y[j] * vN_vE[3];
+					for (k = 0; k < 3; k++)
+						Atb[i][k] += Y[i] * ryg_srgb8_to_float(pixel[k]) * vN_vE[3];
+				}
+			}
+		}
+	}
+
+	// Gaussian elimination with partial pivoting
+	for (i = 0; i < ROUGH_FIT_COEFFS; i++)
+	{
+		int pivot = i;
+		for (j = i + 1; j < ROUGH_FIT_COEFFS; j++)
+			if (fabs(AtA[j][i]) > fabs(AtA[pivot][i]))
+				pivot = j;
+
+		for (j = 0; j < ROUGH_FIT_COEFFS && pivot != i; j++)
+		{
+			double t = AtA[i][j]; AtA[i][j] = AtA[pivot][j]; AtA[pivot][j] = t;
+		}
+		for (k = 0; k < 3 && pivot != i; k++)
+		{
+			double t = Atb[i][k]; Atb[i][k] = Atb[pivot][k]; Atb[pivot][k] = t;
+		}
+
+		for (j = i + 1; j < ROUGH_FIT_COEFFS; j++)
+		{
+			double scale = AtA[j][i] / AtA[i][i];
+			for (k = i; k < ROUGH_FIT_COEFFS; k++)
+				AtA[j][k] -= scale * AtA[i][k];
+			for (k = 0; k < 3; k++)
+				Atb[j][k] -= scale * Atb[i][k];
+		}
+	}
+
+	for (i = ROUGH_FIT_COEFFS - 1; i >= 0; i--)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			double sum = Atb[i][k];
+			for (j = i + 1; j < ROUGH_FIT_COEFFS; j++)
+				sum -= AtA[i][j] * coeffs[j][k];
+			coeffs[i][k] = sum / AtA[i][i];
+		}
+	}
+
+	for (mip = srcMip + 1; mip < outNumMips; mip++)
+	{
+		int mipRes = outRes >> mip;
+
+		for (face = 0; face < 6; face++)
+		{
+			for (y = 0; y < mipRes; y++)
+			{
+				for (x = 0; x < mipRes; x++)
+				{
+					uint8_t *pixel = outData + encodeOutPixel(outRes, face, mip, x, y) * 4;
+					float vN_vE[4], color[3] = {0.0f, 0.0f, 0.0f};
+
+					genNorm(vN_vE, x, y, face, mipRes, calcWarp(mipRes));
+					evalSH(Y, ROUGH_FIT_ORDER, vN_vE);
+
+					for (i = 0; i < ROUGH_FIT_COEFFS; i++)
+						for (k = 0; k < 3; k++)
+							color[k] += coeffs[i][k] * Y[i];
+
+					pixel[0] = ryg_float_to_srgb8(MAX(color[0], 0.0f));
+					pixel[1] = ryg_float_to_srgb8(MAX(color[1], 0.0f));
+					pixel[2] = ryg_float_to_srgb8(MAX(color[2], 0.0f));
+					pixel[3] = 255;
+				}
+			}
+		}
+	}
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Small lobe fast path
+//
+// In the glossiest mips the cone nNL > minNL of conic culling covers a few
+// input texels, yet each face still sets up spans row by row.  For these the
+// cone is projected onto the plane of each face it can reach, and only the
+// texels in its bounding window are weighted.  Each face gets its own window,
+// so seams and corners are read exactly, and each texel once.
+//
+// A direction within angle c of the cone around N, at angle a0 from a face's
+// axis, lands on that face's plane at most sin(c) / (cos(a0) * cos(a0 + c))
+// from where N does.  Faces are reachable when a0 <= 54.74 + c, the angle of
+// a cube corner, so c is limited to keep a0 + c below 90 degrees.
+//
+// Lobes narrower than a texel use the 2x2 texels around N without a cutoff,
+// so they never come up empty.  Needs the FP32 planar layout.
+
+#define SMALL_LOBE_MAX_SIN 0.3f
+
+int smallLobeRadius = 16;
+int smallLobeMip[OUTPUT_MIPS_MAX];
+
+// returns 0 if the lobe is too wide
+int convolveCubemapToVectorWindowed(float outColor[3], float *outWeightAccum, float vN_vE[4], float *inDataFP32, int width, int height, float roughness, float minNL)
+{
+	float alpha = roughness * roughness;
+	float aa = alpha * alpha;
+	float rgbw[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	int face;
+
+	float cosC = minNL;
+	float sinC = sqrtf(MAX(1.0f - minNL * minNL, 0.0f));
+	if (minNL <= 0.0f || sinC > SMALL_LOBE_MAX_SIN)
+		return 0;
+
+	// cos(54.74 + c)
+	float cosReach = 0.5773503f * cosC - 0.8164966f * sinC;
+
+	for (face = 0; face < 6; face++)
+	{
+		float vN_vE_FaceSpace[4];
+		float cutoff = minNL;
+		int startX, endX, startY, endY;
+
+		transformToFaceSpace(vN_vE_FaceSpace, vN_vE, face);
+
+		float cosA0 = vN_vE_FaceSpace[2];
+		if (cosA0 <= cosReach)
+			continue;
+
+		float sinA0 = sqrtf(MAX(1.0f - cosA0 * cosA0, 0.0f));
+		float radius = sinC / (cosA0 * (cosA0 * cosC - sinA0 * sinC)) * width * 0.5f;
+		float centerX = (vN_vE_FaceSpace[0] / cosA0 + 1.0f) * width * 0.5f - 0.5f;
+		float centerY = (vN_vE_FaceSpace[1] / cosA0 + 1.0f) * height * 0.5f - 0.5f;
+
+		if (radius >= 1.0f)
+		{
+			startX = MAX((int)ceilf(centerX - radius), 0);
+			endX = MIN((int)floorf(centerX + radius) + 1, width);
+			startY = MAX((int)ceilf(centerY - radius), 0);
+			endY = MIN((int)floorf(centerY + radius) + 1, height);
+		}
+		else
+		{
+			// few tap filter, on the face N is in
+			if (cosA0 < 0.5773503f || fabsf(vN_vE_FaceSpace[0]) > cosA0 || fabsf(vN_vE_FaceSpace[1]) > cosA0)
+				continue;
+
+			startX = CLAMP((int)floorf(centerX), 0, width - 2);
+			startY = CLAMP((int)floorf(centerY), 0, height - 2);
+			endX = startX + 2;
+			endY = startY + 2;
+			cutoff = 0.0f;
+		}
+
+		convolveWindowToVector(rgbw, vN_vE_FaceSpace, inDataFP32, face, width, height, startX, endX, startY, endY, aa, cutoff);
+	}
+
+	Vec3Set(outColor, rgbw[0], rgbw[1], rgbw[2]);
+	*outWeightAccum = rgbw[3];
+	return 1;
+}
+
+// use the fast path for mips where the lobe at the center of a face is at most smallLobeRadius texels
+void selectSmallLobeMips(int outNumMips, float *inDataFP32, int width, int height, int simSamples)
+{
+	int i, numEnabled = 0;
+
+	for (i = 0; i < outNumMips && i < OUTPUT_MIPS_MAX; i++)
+	{
+		float roughness = calcRoughness(i, outNumMips);
+		float minNL = calcMinNL(roughness, simSamples);
+		float *levelData = inDataFP32;
+		int levelWidth = width, levelHeight = height;
+
+		selectSourceLevel(roughness, &levelData, &levelWidth, &levelHeight);
+
+		float sinC = sqrtf(MAX(1.0f - minNL * minNL, 0.0f));
+		smallLobeMip[i] = levelWidth >= 2 && minNL > 0.0f && sinC <= SMALL_LOBE_MAX_SIN && sinC / minNL * levelWidth * 0.5f <= smallLobeRadius;
+		numEnabled += smallLobeMip[i];
+	}
+
+	printf("Using the small lobe fast path for %d of %d mips.\n", numEnabled, outNumMips);
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Sparse evaluation
+//
+// Wide lobes change slowly across a mip, so in mips where the lobe is at
+// least sparseStep pixels wide, only every sparseStep-th pixel of each face is
+// convolved, plus the last row and column.  The pixels between them are filled
+// in later a cell at a time.  Each cell convolves the pixel nearest its center
+// and compares it with the bilinear interpolation of its corners; if they
+// differ by more than SPARSE_MAX_ERROR levels, the whole cell is convolved.
+// Mips with fewer than SPARSE_MIN_CELLS cells per row have too many of them at
+// seams, where the interpolation is worst.
+
+#define SPARSE_MAX_ERROR 1
+#define SPARSE_MIN_CELLS 4
+
+int sparseStep = 0;
+int sparseMip[OUTPUT_MIPS_MAX];
+
+// set while the grid is convolved, so the pixels between it are skipped
+int sparseGridPass = 0;
+
+static inline int isSparseGridCoord(int x, int mipRes)
+{
+	return x % sparseStep == 0 || x == mipRes - 1;
+}
+
+static inline int isSparseSkipped(int outMipNum, int outMipRes, int outX, int outY)
+{
+	return sparseGridPass && sparseMip[outMipNum] && !(isSparseGridCoord(outX, outMipRes) && isSparseGridCoord(outY, outMipRes));
+}
+
+static inline int calcSparseGridSize(int mipRes)
+{
+	return (mipRes - 1) / sparseStep + 1 + ((mipRes - 1) % sparseStep != 0);
+}
+
+void selectSparseMips(int outRes, int outNumMips)
+{
+	int i, numEnabled = 0;
+
+	for (i = 0; i < outNumMips && i < OUTPUT_MIPS_MAX; i++)
+	{
+		int mipRes = outRes >> i;
+
+		// a texel at the center of a face is 2 / mipRes radians wide
+		sparseMip[i] = mipRes >= SPARSE_MIN_CELLS * sparseStep && !shMipEnabled[i] && !isDerivedMip(i, outNumMips)
+			&& calcLobeWidth(calcRoughness(i, outNumMips)) >= sparseStep * 2.0f / mipRes;
+		numEnabled += sparseMip[i];
+	}
+
+	printf("Evaluating %d of %d mips every %d pixels.\n", numEnabled, outNumMips, sparseStep);
+}
+
+int countSparseCells(int outRes, int outNumMips)
+{
+	int i, numCells = 0;
+
+	for (i = 0; i < outNumMips && i < OUTPUT_MIPS_MAX; i++)
+	{
+		if (sparseMip[i])
+		{
+			int gridSize = calcSparseGridSize(outRes >> i);
+			numCells += (gridSize - 1) * (gridSize - 1) * 6;
+		}
+	}
+
+	return numCells;
+}
+
+// cells are ordered mip, face, then row major, and span grid pixels x0 to x1 and y0 to y1
+void decodeSparseCell(int outRes, int outNumMips, int cellIndex, int *outFace, int *outMipNum, int *outMipRes, int *x0, int *y0, int *x1, int *y1)
+{
+	int i;
+
+	for (i = 0; i < outNumMips && i < OUTPUT_MIPS_MAX; i++)
+	{
+		if (!sparseMip[i])
+			continue;
+
+		int mipRes = outRes >> i;
+		int cellsPerRow = calcSparseGridSize(mipRes) - 1;
+		int numCells = cellsPerRow * cellsPerRow * 6;
+
+		if (cellIndex >= numCells)
+		{
+			cellIndex -= numCells;
+			continue;
+		}
+
+		int cellsPerFace = cellsPerRow * cellsPerRow;
+		int cellX, cellY;
+
+		*outFace = cellIndex / cellsPerFace;
+		cellIndex -= *outFace * cellsPerFace;
+		cellY = cellIndex / cellsPerRow;
+		cellX = cellIndex - cellY * cellsPerRow;
+
+		*outMipNum = i;
+		*outMipRes = mipRes;
+		*x0 = cellX * sparseStep;
+		*y0 = cellY * sparseStep;
+		*x1 = MIN(*x0 + sparseStep, mipRes - 1);
+		*y1 = MIN(*y0 + sparseStep, mipRes - 1);
+		return;
+	}
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Batch engine
+//
+// Several same size cubemaps are convolved together, see the batch kernels.
+// Only the direct convolution is batched, the other engines are per cubemap.
+// Output pixels of each cubemap follow those of the one before.
+
+float *formatDataForBatch(uint8_t **rgba8, int numMaps, int inRes)
+{
+	int face, y, x, i;
+	int stride = (inRes + 15) & ~0x0f;
+	int rowSize = stride * (2 + numMaps * 3);
+	float *outData = _mm_malloc((size_t)rowSize * inRes * 6 * sizeof(*outData), 64);
+	const geometryTable_t *table = getGeometryTable(inRes);
+
+	memset(outData, 0, (size_t)rowSize * inRes * 6 * sizeof(*outData));
+
+	for (face = 0; face < 6; face++)
+	{
+		float *outPixel = outData + face * inRes * rowSize;
+
+		for (y = 0; y < inRes; y++, outPixel += rowSize)
+		{
+			for (x = 0; x < inRes; x++)
+			{
+				float solidAngle = table->solidAngles[y * inRes + x];
+
+				outPixel[x]          = table->invLengths[y * inRes + x];
+				outPixel[x + stride] = solidAngle;
+
+				for (i = 0; i < numMaps; i++)
+				{
+					uint8_t *inPixel = rgba8[i] + ((face * inRes + y) * inRes + x) * 4;
+					float *color = outPixel + x + stride * (2 + i * 3);
+
+					color[0]          = ryg_srgb8_to_float(inPixel[0]) * solidAngle;
+					color[stride]     = ryg_srgb8_to_float(inPixel[1]) * solidAngle;
+					color[stride * 2] = ryg_srgb8_to_float(inPixel[2]) * solidAngle;
+				}
+			}
+		}
+	}
+
+	return outData;
+}
+
+void convolveCubemapToPixelBatch(uint8_t *outData, int outRes, int outNumMips, int outNumPixels, int outPixelCount, float *inData, int numMaps, int width, int height, int simSamples)
+{
+	int outFace, outMipNum, outMipRes, outX, outY, i;
+	float color[BATCH_MAX][3];
+	float weightAccum = 0.0f;
+	float vN_vE[4];
+
+	decodeOutPixel(outRes, outPixelCount, &outFace, &outMipNum, &outMipRes, &outX, &outY);
+
+	// filled in by deriveRoughMips
+	if (isDerivedMip(outMipNum, outNumMips))
+		return;
+
+	const mipPlan_t *plan = &mipPlans[outMipNum];
+
+	genPlanNorm(vN_vE, plan, outX, outY, outFace);
+
+	for (i = 0; i < numMaps; i++)
+		Vec3Set(color[i], 0.0f, 0.0f, 0.0f);
+
+	int f;
+	for (f = 0; f < plan->numFaces[outFace]; f++)
+	{
+		int inFace = plan->faces[outFace][f];
+		float faceColor[BATCH_MAX][3];
+		float faceWeightAccum;
+		float vN_vE_FaceSpace[4];
+
+		transformToFaceSpace(vN_vE_FaceSpace, vN_vE, inFace);
+
+		convolveFaceToVectorBatch(faceColor, &faceWeightAccum, vN_vE_FaceSpace, inData, numMaps, inFace, width, height, plan->roughness, plan->minNL);
+		for (i = 0; i < numMaps; i++)
+			Vec3Add(color[i], color[i], faceColor[i]);
+		weightAccum += faceWeightAccum;
+	}
+
+	if (weightAccum)
+		weightAccum = 1.0f / weightAccum;
+
+	for (i = 0; i < numMaps; i++)
+	{
+		uint8_t *outPixel = outData + ((size_t)i * outNumPixels + outPixelCount) * 4;
+
+		Vec3Scale(color[i], weightAccum, color[i]);
+
+		outPixel[0] = ryg_float_to_srgb8(color[i][0]);
+		outPixel[1] = ryg_float_to_srgb8(color[i][1]);
+		outPixel[2] = ryg_float_to_srgb8(color[i][2]);
+		outPixel[3] = 255;
+	}
+}
+
+void convolveCubemapToPixelBatchRange(uint8_t *outData, int outRes, int outNumMips, int outNumPixels, int begin, int end, float *inData, int numMaps, int width, int height, int simSamples)
+{
+	int i;
+
+	for (i = begin; i < end; i++)
+		convolveCubemapToPixelBatch(outData, outRes, outNumMips, outNumPixels, i, inData, numMaps, width, height, simSamples);
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Convolution matrix
+//
+// For a given resolution and cutoff, the convolution is a fixed sparse matrix
+// from input texels to output pixels.  It's built once and cached in a file,
+// so later runs with the same parameters only do the weighted sums.
+//
+// The cube has 48 symmetries, signed permutations of the axes, and the
+// weights only depend on the angle between N and L and on the solid angle of
+// a texel, both of which they preserve.  So only one pixel of each orbit under
+// them gets a row, and the other pixels read it through the symmetry.  Weights
+// are quantized to 16 bits of the largest in their row, and the rows are
+// normalized by their quantized sum.
+//
+// Rows are stored as runs of texels along input rows, each with its weights.
+// A pixel reads the runs of its row through its symmetry, which takes a run
+// to a run along a row or a column of the input, forwards or back.  So the
+// input is kept as is, mirrored, transposed, and transposed and mirrored, and
+// each run is read forwards along a row of one of them.  Run starts
+// are packed as face << 28 | y << 14 | x, so resolutions are limited to 16384,
+// and counts are 32 bit, so matrices are limited to 2^32 - 1 weights.
+
+#define NUM_SYMMETRIES 48
+#define MATRIX_VERSION 1
+
+typedef struct
+{
+	int face;
+	int swap;
+	int flipX;
+	int flipY;
+}
+symmetryFace_t;
+
+typedef struct
+{
+	char magic[8];
+	int version;
+	int inRes;
+	int numMips;
+	int simSamples;
+	int conicCulling;
+	float lobeEnergyCutoff;
+	int reuseRoughMips;
+	uint32_t numRows;
+	uint32_t numRuns;
+	uint32_t numEntries;
+}
+matrixHeader_t;
+
+char *matrixCacheDir = NULL;
+
+symmetryFace_t symmetryFaces[NUM_SYMMETRIES][6];
+int symmetryInverse[NUM_SYMMETRIES];
+
+struct
+{
+	uint32_t numRows;
+	uint32_t numRuns;
+	uint32_t numEntries;
+	uint32_t *rowPixel;
+	uint32_t *rowStart;
+	uint32_t *rowEntryStart;
+	uint32_t *runTexel;
+	uint16_t *runLength;
+	uint16_t *entryWeight;
+	uint32_t *pixelRow;
+	uint8_t *pixelSymmetry;
+	float *inData;
+	int inRes;
+}
+convMatrix;
+
+// the matrix can be large, so its allocations are checked
+static void *checkMatrixAlloc(void *ptr)
+{
+	if (!ptr)
+	{
+		printf("Error! Out of memory for the convolution matrix.\n");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+// symmetry g takes axis i to axis perm[g / 8][i], flipped if bit i of g is set
+static void applySymmetry(float out[3], float in[3], int g)
+{
+	static const int perms[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+	int i;
+
+	for (i = 0; i < 3; i++)
+		out[perms[g / 8][i]] = (g & (1 << i)) ? -in[i] : in[i];
+}
+
+// find where each symmetry takes the texels of each face, by probing its axes
+void initSymmetries(void)
+{
+	int g, h, face;
+
+	for (g = 0; g < NUM_SYMMETRIES; g++)
+	{
+		for (face = 0; face < 6; face++)
+		{
+			float probeX[4] = {0.5f, 0.0f, 1.0f}, probeY[4] = {0.0f, 0.5f, 1.0f};
+			float dir[4], mapped[4], mappedX[4], mappedY[4];
+			symmetryFace_t *sym = &symmetryFaces[g][face];
+
+			transformFromFaceSpace(dir, probeX, face);
+			applySymmetry(mapped, dir, g);
+			sym->face = calcFaceSpace(mappedX, mapped);
+
+			transformFromFaceSpace(dir, probeY, face);
+			applySymmetry(mapped, dir, g);
+			calcFaceSpace(mappedY, mapped);
+
+			sym->swap = fabsf(mappedX[1]) > fabsf(mappedX[0]);
+			sym->flipX = (sym->swap ? mappedY[0] : mappedX[0]) < 0.0f;
+			sym->flipY = (sym->swap ? mappedX[1] : mappedY[1]) < 0.0f;
+		}
+	}
+
+	for (g = 0; g < NUM_SYMMETRIES; g++)
+	{
+		for (h = 0; h < NUM_SYMMETRIES; h++)
+		{
+			float v[3] = {1.0f, 2.0f, 3.0f}, gv[3], hgv[3];
+
+			applySymmetry(gv, v, g);
+			applySymmetry(hgv, gv, h);
+			if (hgv[0] == v[0] && hgv[1] == v[1] && hgv[2] == v[2])
+				symmetryInverse[g] = h;
+		}
+	}
+}
+
+static inline void mapSymmetricTexel(int g, int face, int x, int y, int res, int *outFace, int *outX, int *outY)
+{
+	const symmetryFace_t *sym = &symmetryFaces[g][face];
+	int mappedX = sym->swap ? y : x;
+	int mappedY = sym->swap ? x : y;
+
+	*outFace = sym->face;
+	*outX = sym->flipX ? res - 1 - mappedX : mappedX;
+	*outY = sym->flipY ? res - 1 - mappedY : mappedY;
+}
+
+// give each pixel of a non derived mip the row of the first pixel of its orbit
+void assignMatrixRows(int outRes, int outNumMips, int outNumPixels)
+{
+	int i, g;
+
+	convMatrix.pixelRow = checkMatrixAlloc(malloc(outNumPixels * sizeof(*convMatrix.pixelRow)));
+	convMatrix.pixelSymmetry = checkMatrixAlloc(malloc(outNumPixels));
+	convMatrix.rowPixel = checkMatrixAlloc(malloc(outNumPixels * sizeof(*convMatrix.rowPixel)));
+	convMatrix.numRows = 0;
+
+	for (i = 0; i < outNumPixels; i++)
+	{
+		int outFace, outMipNum, outMipRes, outX, outY;
+		int first = i, firstSymmetry = 0;
+
+		decodeOutPixel(outRes, i, &outFace, &outMipNum, &outMipRes, &outX, &outY);
+
+		if (isDerivedMip(outMipNum, outNumMips))
+		{
+			convMatrix.pixelRow[i] = 0xffffffff;
+			continue;
+		}
+
+		for (g = 1; g < NUM_SYMMETRIES; g++)
+		{
+			int face, x, y;
+
+			mapSymmetricTexel(g, outFace, outX, outY, outMipRes, &face, &x, &y);
+
+			int pixel = encodeOutPixel(outRes, face, outMipNum, x, y);
+			if (pixel < first)
+			{
+				first = pixel;
+				firstSymmetry = g;
+			}
+		}
+
+		// the first pixel of an orbit comes before the others
+		if (first == i)
+		{
+			convMatrix.rowPixel[convMatrix.numRows] = i;
+			convMatrix.pixelRow[i] = convMatrix.numRows++;
+		}
+		else
+			convMatrix.pixelRow[i] = convMatrix.pixelRow[first];
+
+		// rows hold weights for the first pixel, so map its texels back
+		convMatrix.pixelSymmetry[i] = symmetryInverse[firstSymmetry];
+	}
+}
+
+// rows are one per orbit, so per mip the pixels of one face modulo the 8
+// symmetries of a square, and a row has about the texels within the cutoff,
+// counted on the sphere as plane culling can reach nNL > minNL / sqrt(3), with
+// a margin since texels are denser toward the corners of a face
+double estimateMatrixEntries(int inRes, int outNumMips, int simSamples)
+{
+	double numEntries = 0.0;
+	int mip;
+
+	for (mip = 0; mip < outNumMips; mip++)
+	{
+		int half = ((inRes >> mip) + 1) / 2;
+		float minNL = calcMinNL(calcRoughness(mip, outNumMips), simSamples);
+
+		if (isDerivedMip(mip, outNumMips))
+			continue;
+
+		if (!conicCulling)
+			minNL *= 0.5773503f;
+
+		numEntries += half * (half + 1) / 2.0 * (1.0 - minNL) * 0.5 * 6.0 * inRes * inRes * 1.25;
+	}
+
+	return numEntries;
+}
+
+// weights of the texels for each row, as with the scalar kernel
+void buildMatrixEntries(int outRes, int outNumMips, int inRes, int simSamples)
+{
+	size_t runCapacity = 1 << 16, entryCapacity = 1 << 20;
+	const geometryTable_t *table = getGeometryTable(inRes);
+	float *weights = checkMatrixAlloc(malloc((size_t)inRes * inRes * 6 * sizeof(*weights)));
+	uint32_t *runTexels = checkMatrixAlloc(malloc(inRes * 6 * sizeof(*runTexels)));
+	int *runLengths = checkMatrixAlloc(malloc(inRes * 6 * sizeof(*runLengths)));
+	uint32_t row;
+	int x, y;
+
+	convMatrix.rowStart = checkMatrixAlloc(malloc((convMatrix.numRows + 1) * sizeof(*convMatrix.rowStart)));
+	convMatrix.rowEntryStart = checkMatrixAlloc(malloc((convMatrix.numRows + 1) * sizeof(*convMatrix.rowEntryStart)));
+	convMatrix.runTexel = checkMatrixAlloc(malloc(runCapacity * sizeof(*convMatrix.runTexel)));
+	convMatrix.runLength = checkMatrixAlloc(malloc(runCapacity * sizeof(*convMatrix.runLength)));
+	convMatrix.entryWeight = checkMatrixAlloc(malloc(entryCapacity * sizeof(*convMatrix.entryWeight)));
+	convMatrix.numRuns = 0;
+	convMatrix.numEntries = 0;
+
+	for (row = 0; row < convMatrix.numRows; row++)
+	{
+		int outFace, outMipNum, outMipRes, outX, outY, f, i, j;
+		int numRuns = 0, numWeights = 0;
+		float maxWeight = 0.0f;
+		float vN_vE[4];
+
+		decodeOutPixel(outRes, convMatrix.rowPixel[row], &outFace, &outMipNum, &outMipRes, &outX, &outY);
+
+		const mipPlan_t *plan = &mipPlans[outMipNum];
+		float minNL = plan->minNL;
+		float aa = plan->aa, c1 = plan->c1, c2 = plan->c2;
+
+		genPlanNorm(vN_vE, plan, outX, outY, outFace);
+
+		for (f = 0; f < plan->numFaces[outFace]; f++)
+		{
+			int face = plan->faces[outFace][f];
+			float vN_vE_FaceSpace[4];
+			int startY, endY;
+
+			transformToFaceSpace(vN_vE_FaceSpace, vN_vE, face);
+
+			if (!calcValidRows(vN_vE_FaceSpace, inRes, inRes, minNL, &startY, &endY))
+				continue;
+
+			for (y = startY; y < endY; y++)
+			{
+				float NL = vN_vE_FaceSpace[1] * (-1.0f + (2.0f * y + 1.0f) / inRes) + vN_vE_FaceSpace[2];
+				int startX, endX;
+
+				if (!calcValidColumns(vN_vE_FaceSpace, y, inRes, inRes, minNL, &startX, &endX))
+					continue;
+
+				runTexels[numRuns] = (face << 28) | (y << 14) | startX;
+				runLengths[numRuns++] = endX - startX;
+
+				for (x = startX; x < endX; x++)
+				{
+					float nNL = (vN_vE_FaceSpace[0] * (-1.0f + (2.0f * x + 1.0f) / inRes) + NL) * table->invLengths[y * inRes + x];
+					float d = nNL * c1 + c2;
+					float weight = (nNL > 0.0f) ? table->solidAngles[y * inRes + x] * aa / (d * d) * nNL : 0.0f;
+
+					weights[numWeights++] = weight;
+					maxWeight = MAX(maxWeight, weight);
+				}
+			}
+		}
+
+		// in case the estimate in main was short
+		if ((uint64_t)convMatrix.numEntries + numWeights > UINT32_MAX)
+		{
+			printf("Error! The convolution matrix has more than %u weights, run without -k.\n", UINT32_MAX);
+			exit(1);
+		}
+
+		while (convMatrix.numRuns + numRuns > runCapacity)
+		{
+			runCapacity *= 2;
+			convMatrix.runTexel = checkMatrixAlloc(realloc(convMatrix.runTexel, runCapacity * sizeof(*convMatrix.runTexel)));
+			convMatrix.runLength = checkMatrixAlloc(realloc(convMatrix.runLength, runCapacity * sizeof(*convMatrix.runLength)));
+		}
+
+		while (convMatrix.numEntries + numWeights > entryCapacity)
+		{
+			entryCapacity *= 2;
+			convMatrix.entryWeight = checkMatrixAlloc(realloc(convMatrix.entryWeight, entryCapacity * sizeof(*convMatrix.entryWeight)));
+		}
+
+		convMatrix.rowStart[row] = convMatrix.numRuns;
+		convMatrix.rowEntryStart[row] = convMatrix.numEntries;
+
+		// quantize, trimming texels that round to 0 from the ends of runs
+		for (i = 0, j = 0; i < numRuns; j += runLengths[i++])
+		{
+			int start = 0, end = runLengths[i];
+
+			while (start < end && weights[j + start] / maxWeight * 65535.0f < 0.5f)
+				start++;
+			while (end > start && weights[j + end - 1] / maxWeight * 65535.0f < 0.5f)
+				end--;
+			if (start == end)
+				continue;
+
+			convMatrix.runTexel[convMatrix.numRuns] = runTexels[i] + start;
+			convMatrix.runLength[convMatrix.numRuns++] = end - start;
+
+			for (x = start; x < end; x++)
+				convMatrix.entryWeight[convMatrix.numEntries++] = (int)(weights[j + x] / maxWeight * 65535.0f + 0.5f);
+		}
+	}
+	convMatrix.rowStart[convMatrix.numRows] = convMatrix.numRuns;
+	convMatrix.rowEntryStart[convMatrix.numRows] = convMatrix.numEntries;
+
+	free(weights);
+	free(runTexels);
+	free(runLengths);
+}
+
+static void fillMatrixHeader(matrixHeader_t *header, int inRes, int outNumMips, int simSamples)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, "GGXCCMAT", 8);
+	header->version = MATRIX_VERSION;
+	header->inRes = inRes;
+	header->numMips = outNumMips;
+	header->simSamples = simSamples;
+	header->conicCulling = conicCulling;
+	header->lobeEnergyCutoff = lobeEnergyCutoff;
+	header->reuseRoughMips = reuseRoughMips;
+	header->numRows = convMatrix.numRows;
+}
+
+// check that the rows and runs of a loaded matrix stay within it and the input
+static int validateConvolutionMatrix(int inRes)
+{
+	uint32_t row, i;
+
+	if (convMatrix.rowStart[0] != 0 || convMatrix.rowStart[convMatrix.numRows] != convMatrix.numRuns
+	 || convMatrix.rowEntryStart[0] != 0 || convMatrix.rowEntryStart[convMatrix.numRows] != convMatrix.numEntries)
+		return 0;
+
+	for (row = 0; row < convMatrix.numRows; row++)
+	{
+		uint32_t numEntries = 0;
+
+		if (convMatrix.rowStart[row + 1] < convMatrix.rowStart[row] || convMatrix.rowEntryStart[row + 1] < convMatrix.rowEntryStart[row])
+			return 0;
+
+		for (i = convMatrix.rowStart[row]; i < convMatrix.rowStart[row + 1]; i++)
+		{
+			uint32_t texel = convMatrix.runTexel[i];
+			uint32_t face = texel >> 28, y = (texel >> 14) & 0x3fff, x = texel & 0x3fff;
+
+			if (face >= 6 || y >= inRes || x + convMatrix.runLength[i] > inRes)
+				return 0;
+
+			numEntries += convMatrix.runLength[i];
+		}
+
+		if (numEntries != convMatrix.rowEntryStart[row + 1] - convMatrix.rowEntryStart[row])
+			return 0;
+	}
+
+	return 1;
+}
+
+// returns 0 if missing, damaged, or built with other parameters
+int loadConvolutionMatrix(const char *filename, int inRes, int outNumMips, int simSamples)
+{
+	matrixHeader_t header, expected;
+	FILE *fp = fopen(filename, "rb");
+	uint32_t numRows = convMatrix.numRows + 1;
+	int ok;
+
+	if (!fp)
+		return 0;
+
+	fillMatrixHeader(&expected, inRes, outNumMips, simSamples);
+
+	ok = fread(&header, sizeof(header), 1, fp) == 1;
+	expected.numRuns = header.numRuns;
+	expected.numEntries = header.numEntries;
+	ok = ok && !memcmp(&header, &expected, sizeof(header));
+
+	if (ok)
+	{
+		convMatrix.numRuns = header.numRuns;
+		convMatrix.numEntries = header.numEntries;
+		convMatrix.rowStart = checkMatrixAlloc(malloc(numRows * sizeof(*convMatrix.rowStart)));
+		convMatrix.rowEntryStart = checkMatrixAlloc(malloc(numRows * sizeof(*convMatrix.rowEntryStart)));
+		convMatrix.runTexel = checkMatrixAlloc(malloc(MAX(convMatrix.numRuns, 1) * sizeof(*convMatrix.runTexel)));
+		convMatrix.runLength = checkMatrixAlloc(malloc(MAX(convMatrix.numRuns, 1) * sizeof(*convMatrix.runLength)));
+		convMatrix.entryWeight = checkMatrixAlloc(malloc((size_t)MAX(convMatrix.numEntries, 1) * sizeof(*convMatrix.entryWeight)));
+
+		ok = fread(convMatrix.rowStart, sizeof(*convMatrix.rowStart), numRows, fp) == numRows
+		  && fread(convMatrix.rowEntryStart, sizeof(*convMatrix.rowEntryStart), numRows, fp) == numRows
+		  && fread(convMatrix.runTexel, sizeof(*convMatrix.runTexel), convMatrix.numRuns, fp) == convMatrix.numRuns
+		  && fread(convMatrix.runLength, sizeof(*convMatrix.runLength), convMatrix.numRuns, fp) == convMatrix.numRuns
+		  && fread(convMatrix.entryWeight, sizeof(*convMatrix.entryWeight), convMatrix.numEntries, fp) == convMatrix.numEntries
+		  && validateConvolutionMatrix(inRes);
+
+		if (!ok)
+		{
+			free(convMatrix.rowStart);
+			free(convMatrix.rowEntryStart);
+			free(convMatrix.runTexel);
+			free(convMatrix.runLength);
+			free(convMatrix.entryWeight);
+		}
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+// written to a temporary file and renamed, so an interrupted save leaves no file
+// returns 0 on failure
+int saveConvolutionMatrix(const char *filename, int inRes, int outNumMips, int simSamples)
+{
+	matrixHeader_t header;
+	char tempFilename[1024 + 4];
+	uint32_t numRows = convMatrix.numRows + 1;
+	FILE *fp;
+	int ok;
+
+	snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", filename);
+	fp = fopen(tempFilename, "wb");
+
+	if (!fp)
+	{
+		printf("Can't write %s, not caching the convolution matrix.\n", tempFilename);
+		return 0;
+	}
+
+	fillMatrixHeader(&header, inRes, outNumMips, simSamples);
+	header.numRuns = convMatrix.numRuns;
+	header.numEntries = convMatrix.numEntries;
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1
+	  && fwrite(convMatrix.rowStart, sizeof(*convMatrix.rowStart), numRows, fp) == numRows
+	  && fwrite(convMatrix.rowEntryStart, sizeof(*convMatrix.rowEntryStart), numRows, fp) == numRows
+	  && fwrite(convMatrix.runTexel, sizeof(*convMatrix.runTexel), convMatrix.numRuns, fp) == convMatrix.numRuns
+	  && fwrite(convMatrix.runLength, sizeof(*convMatrix.runLength), convMatrix.numRuns, fp) == convMatrix.numRuns
+	  && fwrite(convMatrix.entryWeight, sizeof(*convMatrix.entryWeight), convMatrix.numEntries, fp) == convMatrix.numEntries;
+	ok = !fclose(fp) && ok;
+
+	// rename doesn't replace an existing file on Windows
+	if (ok)
+	{
+		remove(filename);
+		ok = !rename(tempFilename, filename);
+	}
+
+	if (!ok)
+	{
+		remove(tempFilename);
+		printf("Can't write %s, not caching the convolution matrix.\n", filename);
+	}
+
+	return ok;
+}
+
+// load the matrix for these parameters from the cache, or build and save it
+void prepareConvolutionMatrix(uint8_t *rgba8, int inRes, int outNumMips, int outNumPixels, int simSamples)
+{
+	int numTexels = inRes * inRes * 6;
+	char filename[1024];
+	int face, x, y, i;
+
+	snprintf(filename, sizeof(filename), "%s/ggxcc_%d_%d_%s_%g_%d.mat", matrixCacheDir, inRes, simSamples,
+		conicCulling ? "conic" : "plane", lobeEnergyCutoff, reuseRoughMips);
+
+	initSymmetries();
+	assignMatrixRows(inRes, outNumMips, outNumPixels);
+
+	if (loadConvolutionMatrix(filename, inRes, outNumMips, simSamples))
+		printf("Loaded convolution matrix from %s.\n", filename);
+	else
+	{
+		buildMatrixEntries(inRes, outNumMips, inRes, simSamples);
+		if (saveConvolutionMatrix(filename, inRes, outNumMips, simSamples))
+			printf("Built convolution matrix, saved to %s.\n", filename);
+		else
+			printf("Built convolution matrix.\n");
+	}
+
+	printf("Convolution matrix has %u rows for %d pixels, %u runs, and %u weights.\n", convMatrix.numRows, outNumPixels, convMatrix.numRuns, convMatrix.numEntries);
+
+	// linear R, G, and B planes of the input, mirrored, transposed, and both
+	convMatrix.inRes = inRes;
+	convMatrix.inData = checkMatrixAlloc(malloc((size_t)numTexels * 3 * 4 * sizeof(*convMatrix.inData)));
+
+	for (face = 0; face < 6; face++)
+	{
+		for (y = 0; y < inRes; y++)
+		{
+			for (x = 0; x < inRes; x++)
+			{
+				uint8_t *inPixel = rgba8 + ((face * inRes + y) * inRes + x) * 4;
+				float *outPlanes = convMatrix.inData + face * inRes * inRes;
+				int mx = inRes - 1 - x, my = inRes - 1 - y;
+
+				for (i = 0; i < 3; i++, outPlanes += numTexels)
+				{
+					float linear = ryg_srgb8_to_float(inPixel[i]);
+
+					outPlanes[y * inRes + x] = linear;
+					outPlanes[numTexels * 3 + y * inRes + mx] = linear;
+					outPlanes[numTexels * 6 + x * inRes + y] = linear;
+					outPlanes[numTexels * 9 + x * inRes + my] = linear;
+				}
+			}
+		}
+	}
+}
+
+void convolveCubemapToPixelMatrix(uint8_t *outData, int outPixelCount)
+{
+	uint8_t *outPixel = outData + outPixelCount * 4;
+	uint32_t row = convMatrix.pixelRow[outPixelCount];
+	int res = convMatrix.inRes;
+	int numTexels = res * res * 6;
+	float red = 0.0f, green = 0.0f, blue = 0.0f, weightAccum = 0.0f;
+	uint32_t i;
+
+	// filled in by deriveRoughMips
+	if (row == 0xffffffff)
+		return;
+
+	int g = convMatrix.pixelSymmetry[outPixelCount];
+	uint16_t *weight = convMatrix.entryWeight + convMatrix.rowEntryStart[row];
+
+	for (i = convMatrix.rowStart[row]; i < convMatrix.rowStart[row + 1]; i++)
+	{
+		uint32_t texel = convMatrix.runTexel[i];
+		int length = convMatrix.runLength[i];
+		int face = texel >> 28, inFace, inX, inY;
+		const symmetryFace_t *sym = &symmetryFaces[g][face];
+		int x;
+
+		// where the symmetry takes the start of the run, and its direction
+		mapSymmetricTexel(g, face, texel & 0x3fff, (texel >> 14) & 0x3fff, res, &inFace, &inX, &inY);
+
+		// read forwards from the copy where the run is along a row
+		int reverse = sym->swap ? sym->flipY : sym->flipX;
+		int a = sym->swap ? inX : inY;
+		int b = sym->swap ? inY : inX;
+		float *inRed = convMatrix.inData + numTexels * 3 * (sym->swap * 2 + reverse) + (inFace * res + a) * res + (reverse ? res - 1 - b : b);
+		float *inGreen = inRed + numTexels;
+		float *inBlue = inRed + numTexels * 2;
+
+		for (x = 0; x < length; x++)
+		{
+			float w = weight[x];
+
+			red += inRed[x] * w;
+			green += inGreen[x] * w;
+			blue += inBlue[x] * w;
+			weightAccum += w;
+		}
+
+		weight += length;
+	}
+
+	if (weightAccum)
+		weightAccum = 1.0f / weightAccum;
+
+	outPixel[0] = ryg_float_to_srgb8(red * weightAccum);
+	outPixel[1] = ryg_float_to_srgb8(green * weightAccum);
+	outPixel[2] = ryg_float_to_srgb8(blue * weightAccum);
+	outPixel[3] = 255;
+}
+
+void convolveCubemapToPixelMatrixRange(uint8_t *outData, int begin, int end)
+{
+	int i;
+
+	for (i = begin; i < end; i++)
+		convolveCubemapToPixelMatrix(outData, i);
+}
+
+// ***************************************************************************
+
+// ***************************************************************************
+// Preview engine
+//
+// For quick iteration, each mip is a Gaussian blur of the input at that mip's
+// resolution, with the same half width as its lobe at the center of a face.
+// Faces are padded with texels from their neighbours, found by projecting the
+// padding's directions, and blurred separably in face space.  Results are
+// approximate, especially in the rough mips, where a face's padding is capped
+// at its own size.
+
+#define PREVIEW_RADIUS_MAX 1024
+
+int previewMode = 0;
+
+void convolveCubemapPreview(uint8_t *outData, int outRes, int outNumMips, uint8_t *inData, int inRes, int inNumMips)
+{
+	uint8_t *levelData = extractInputLevel(inData, inRes, inNumMips, 0);
+	int mip, face, x, y, i, k;
+
+	for (mip = 0; mip < outNumMips; mip++)
+	{
+		int mipRes = outRes >> mip;
+
+		if (mip > 0)
+		{
+			uint8_t *nextData = (mip < inNumMips) ? extractInputLevel(inData, inRes, inNumMips, mip) : downsampleInputLevel(levelData, outRes >> (mip - 1));
+			free(levelData);
+			levelData = nextData;
+		}
+
+		// sigma from the half width at half maximum, in texels at the center of a face
+		float sigma = tanf(MIN(calcLobeWidth(calcRoughness(mip, outNumMips)) / 1.1774100f, 1.0f)) * mipRes * 0.5f;
+		int radius = MIN((int)ceilf(sigma * 3.0f), MIN(mipRes, PREVIEW_RADIUS_MAX));
+		int paddedRes = mipRes + radius * 2;
+		float kernel[2 * PREVIEW_RADIUS_MAX + 1];
+		float kernelSum = 0.0f;
+
+		for (k = -radius; k <= radius; k++)
+			kernelSum += kernel[k + radius] = (sigma > 0.0f) ? expf(-0.5f * k * k / (sigma * sigma)) : (k == 0);
+		for (k = -radius; k <= radius; k++)
+			kernel[k + radius] /= kernelSum;
+
+		float (*padded)[3] = malloc(paddedRes * paddedRes * sizeof(*padded));
+		float (*blurred)[3] = malloc(paddedRes * mipRes * sizeof(*blurred));
+
+		for (face = 0; face < 6; face++)
+		{
+			for (y = -radius; y < mipRes + radius; y++)
+			{
+				for (x = -radius; x < mipRes + radius; x++)
+				{
+					int inFace = face, inX = x, inY = y;
+
+					if (x < 0 || y < 0 || x >= mipRes || y >= mipRes)
+					{
+						float vN_vE[4], vN_vE_FaceSpace[4];
+
+						vN_vE_FaceSpace[0] = -1.0f + (2.0f * x + 1.0f) / mipRes;
+						vN_vE_FaceSpace[1] = -1.0f + (2.0f * y + 1.0f) / mipRes;
+						vN_vE_FaceSpace[2] = 1.0f;
+						transformFromFaceSpace(vN_vE, vN_vE_FaceSpace, face);
+
+						inFace = calcFaceSpace(vN_vE_FaceSpace, vN_vE);
+						inX = (int)floorf((vN_vE_FaceSpace[0] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * mipRes);
+						inY = (int)floorf((vN_vE_FaceSpace[1] / vN_vE_FaceSpace[2] + 1.0f) * 0.5f * mipRes);
+						inX = CLAMP(inX, 0, mipRes - 1);
+						inY = CLAMP(inY, 0, mipRes - 1);
+					}
+
+					uint8_t *inPixel = levelData + ((inFace * mipRes + inY) * mipRes + inX) * 4;
+					float *pixel = padded[(y + radius) * paddedRes + x + radius];
+					pixel[0] = ryg_srgb8_to_float(inPixel[0]);
+					pixel[1] = ryg_srgb8_to_float(inPixel[1]);
+					pixel[2] = ryg_srgb8_to_float(inPixel[2]);
+				}
+			}
+
+			// rows, then columns
+			for (y = 0; y < paddedRes; y++)
+			{
+				for (x = 0; x < mipRes; x++)
+				{
+					float color[3] = {0.0f, 0.0f, 0.0f};
+
+					for (k = 0; k <= radius * 2; k++)
+						for (i = 0; i < 3; i++)
+							color[i] += padded[y * paddedRes + x + k][i] * kernel[k];
+
+					Vec3Set(blurred[y * mipRes + x], color[0], color[1], color[2]);
+				}
+			}
+
+			for (y = 0; y < mipRes; y++)
+			{
+				uint8_t *outPixel = outData + encodeOutPixel(outRes, face, mip, 0, y) * 4;
+
+				for (x = 0; x < mipRes; x++, outPixel += 4)
+				{
+					float color[3] = {0.0f, 0.0f, 0.0f};
+
+					for (k = 0; k <= radius * 2; k++)
+						for (i = 0; i < 3; i++)
+							color[i] += blurred[(y + k) * mipRes + x][i] * kernel[k];
+
+					outPixel[0] = ryg_float_to_srgb8(color[0]);
+					outPixel[1] = ryg_float_to_srgb8(color[1]);
+					outPixel[2] = ryg_float_to_srgb8(color[2]);
+					outPixel[3] = 255;
+				}
+			}
+		}
+
+		free(blurred);
+		free(padded);
+	}
+
+	free(levelData);
+}
+
+// ***************************************************************************
+
+// outMip points to texel 0, 0 of the output face and mip
+void convolveCubemapToTexel(uint8_t *outMip, int outNumMips, int outFace, int outMipNum, int outX, int outY, float *inDataFP32, int width, int height, int simSamples)
+{
+	const mipPlan_t *plan = &mipPlans[outMipNum];
+	uint8_t *outPixel = outMip + (outY * plan->mipRes + outX) * 4;
+	float color[3] = {0.0f, 0.0f, 0.0f};
+	float vN_vE[4];
+
+	// filled in by deriveRoughMips
+	if (isDerivedMip(outMipNum, outNumMips))
+		return;
+
+	// filled in by fillSparseCell
+	if (isSparseSkipped(outMipNum, plan->mipRes, outX, outY))
+		return;
+	
+	float roughness = plan->roughness;
+	float minNL = plan->minNL;
+
+	getPlanSource(plan, &inDataFP32, &width, &height);
+
+	genPlanNorm(vN_vE, plan, outX, outY, outFace);
+
 	float weightAccum = 0.0f;
-	int inFace;
-	for (inFace = 0; inFace < 6; inFace++)
+	if (shMipEnabled[outMipNum])
+		convolveCubemapToVectorSH(color, &weightAccum, vN_vE, outMipNum);
+	else if (importanceSamples)
+		convolveCubemapToVectorSampled(color, &weightAccum, vN_vE, outMipNum);
+	else if (tileEpsilon)
+		convolveCubemapToVectorTiled(color, &weightAccum, vN_vE, inDataFP32, width, height, roughness);
+	else if (!smallLobeMip[outMipNum] || !convolveCubemapToVectorWindowed(color, &weightAccum, vN_vE, inDataFP32, width, height, roughness, minNL))
+	{
+		int i;
+		for (i = 0; i < plan->numFaces[outFace]; i++)
+		{
+			int inFace = plan->faces[outFace][i];
+			float faceColor[3];
+			float faceWeightAccum = 0.0f;
+			float vN_vE_FaceSpace[4];
+			
+			transformToFaceSpace(vN_vE_FaceSpace, vN_vE, inFace);
+			
+			convolveFaceToVector(faceColor, &faceWeightAccum, vN_vE_FaceSpace, inDataFP32, inFace, width, height, roughness, minNL);
+			Vec3Add(color, color, faceColor);
+			weightAccum += faceWeightAccum;
+		}
+	}
+
+	if (weightAccum)
+		weightAccum = 1.0f / weightAccum;
+
+	Vec3Scale(color, weightAccum, color);
+	
+	outPixel[0] = ryg_float_to_srgb8(color[0]);
+	outPixel[1] = ryg_float_to_srgb8(color[1]);
+	outPixel[2] = ryg_float_to_srgb8(color[2]);
+	outPixel[3] = 255;
+}
+
+void convolveCubemapToPixel(uint8_t *outData, int outRes, int outNumMips, int outPixelCount, float *inDataFP32, int width, int height, int simSamples)
+{
+	int outFace, outMipNum, outMipRes, outX, outY;
+
+	decodeOutPixel(outRes, outPixelCount, &outFace, &outMipNum, &outMipRes, &outX, &outY);
+
+	convolveCubemapToTexel(outData + (outPixelCount - outY * outMipRes - outX) * 4, outNumMips, outFace, outMipNum, outX, outY, inDataFP32, width, height, simSamples);
+}
+
+// convolve numPixels nearby pixels of one face and mip with one pass over the input
+void convolveCubemapToTexels(uint8_t *outMip, int outFace, int outMipNum, int numPixels, int pixelXY[][2], float *inDataFP32, int width, int height)
+{
+	float color[CONVOLVE_BLOCK_MAX][3];
+	float weightAccum[CONVOLVE_BLOCK_MAX];
+	float vN_vE[CONVOLVE_BLOCK_MAX][4];
+	int i;
+	
+	const mipPlan_t *plan = &mipPlans[outMipNum];
+	float roughness = plan->roughness;
+	float minNL = plan->minNL;
+
+	getPlanSource(plan, &inDataFP32, &width, &height);
+
+	for (i = 0; i < numPixels; i++)
+	{
+		genPlanNorm(vN_vE[i], plan, pixelXY[i][0], pixelXY[i][1], outFace);
+		Vec3Set(color[i], 0.0f, 0.0f, 0.0f);
+		weightAccum[i] = 0.0f;
+	}
+
+	int f;
+	for (f = 0; f < plan->numFaces[outFace]; f++)
+	{
+		int inFace = plan->faces[outFace][f];
+		float faceColor[CONVOLVE_BLOCK_MAX][3];
+		float faceWeightAccum[CONVOLVE_BLOCK_MAX];
+		float vN_vE_FaceSpace[CONVOLVE_BLOCK_MAX][4];
+		
+		for (i = 0; i < numPixels; i++)
+			transformToFaceSpace(vN_vE_FaceSpace[i], vN_vE[i], inFace);
+		
+		convolveFaceToVectors(faceColor, faceWeightAccum, vN_vE_FaceSpace, numPixels, inDataFP32, inFace, width, height, roughness, minNL);
+
+		for (i = 0; i < numPixels; i++)
+		{
+			Vec3Add(color[i], color[i], faceColor[i]);
+			weightAccum[i] += faceWeightAccum[i];
+		}
+	}
+
+	for (i = 0; i < numPixels; i++)
+	{
+		uint8_t *outPixel = outMip + (pixelXY[i][1] * plan->mipRes + pixelXY[i][0]) * 4;
+
+		if (weightAccum[i])
+			weightAccum[i] = 1.0f / weightAccum[i];
+
+		Vec3Scale(color[i], weightAccum[i], color[i]);
+		
+		outPixel[0] = ryg_float_to_srgb8(color[i][0]);
+		outPixel[1] = ryg_float_to_srgb8(color[i][1]);
+		outPixel[2] = ryg_float_to_srgb8(color[i][2]);
+		outPixel[3] = 255;
+	}
+}
+
+// ***
+// Cache-blocked schedule
+// ***
+//
+// Instead of each output pixel streaming all six input faces, a square tile of
+// output pixels walks the input in chunks of rows small enough to stay in L2,
+// keeping partial sums per pixel.  Neighbouring pixels have overlapping lobes,
+// so each chunk is loaded once per tile instead of once per pixel.
+//
+// The kernels see a chunk through rowWindowBegin/End, so any of them can be
+// used unchanged.
+
+#define SCHEDULE_TILE_MAX 32
+#define SCHEDULE_CHUNK_BYTES (256 * 1024)
+
+int scheduleTileSize = 0;
+
+int countOutputTiles(int outRes, int tileSize)
+{
+	int mipRes, numTiles = 0;
+
+	for (mipRes = outRes; mipRes; mipRes >>= 1)
+		numTiles += ((mipRes + tileSize - 1) / tileSize) * ((mipRes + tileSize - 1) / tileSize);
+
+	return numTiles * 6;
+}
+
+// tiles are ordered face, mip, then row major
+void decodeOutputTile(int outRes, int tileSize, int tileIndex, int *outFace, int *outMipNum, int *outMipRes, int *outX, int *outY)
+{
+	int numFaceTiles = countOutputTiles(outRes, tileSize) / 6;
+	int mipRes = outRes;
+	int tilesPerRow = (mipRes + tileSize - 1) / tileSize;
+
+	*outFace = tileIndex / numFaceTiles;
+	tileIndex -= *outFace * numFaceTiles;
+
+	*outMipNum = 0;
+	while (tileIndex >= tilesPerRow * tilesPerRow)
+	{
+		tileIndex -= tilesPerRow * tilesPerRow;
+		mipRes >>= 1;
+		tilesPerRow = (mipRes + tileSize - 1) / tileSize;
+		(*outMipNum)++;
+	}
+
+	*outMipRes = mipRes;
+	*outY = (tileIndex / tilesPerRow) * tileSize;
+	*outX = (tileIndex % tilesPerRow) * tileSize;
+}
+
+void convolveCubemapToTile(uint8_t *outData, int outRes, int outNumMips, int tileIndex, int tileSize, int blockSize, float *inDataFP32, int width, int height, int simSamples)
+{
+	int outFace, outMipNum, outMipRes, outX, outY;
+	float color[SCHEDULE_TILE_MAX * SCHEDULE_TILE_MAX][3];
+	float weightAccum[SCHEDULE_TILE_MAX * SCHEDULE_TILE_MAX];
+	float vN_vE[SCHEDULE_TILE_MAX * SCHEDULE_TILE_MAX][4];
+	float vN_vE_FaceSpace[SCHEDULE_TILE_MAX * SCHEDULE_TILE_MAX][4];
+	int validY[SCHEDULE_TILE_MAX * SCHEDULE_TILE_MAX][2];
+	int i, x, y;
+
+	decodeOutputTile(outRes, tileSize, tileIndex, &outFace, &outMipNum, &outMipRes, &outX, &outY);
+
+	int tileWidth = MIN(tileSize, outMipRes - outX);
+	int tileHeight = MIN(tileSize, outMipRes - outY);
+	int numPixels = tileWidth * tileHeight;
+
+	// spherical harmonic, derived, small lobe and sparse mips are done per pixel
+	if (shMipEnabled[outMipNum] || isDerivedMip(outMipNum, outNumMips) || smallLobeMip[outMipNum] || sparseMip[outMipNum])
 	{
-		int inAxis = inFace / 2;
-		int inAxisNeg = inFace & 1;
-		float faceColor[3];
-		float faceWeightAccum = 0.0f;
-		float vN_vE_FaceSpace[4];
-		
-		// transform vN_vE to face space
-		vN_vE_FaceSpace[0] = (inAxis == 0) ? (inAxisNeg ? vN_vE[2] : -vN_vE[2]) : ((inFace == 5) ? -vN_vE[0] : vN_vE[0]);
-		vN_vE_FaceSpace[1] = (inAxis == 1) ? (inAxisNeg ? -vN_vE[2] : vN_vE[2]) : -vN_vE[1];
-		vN_vE_FaceSpace[2] = inAxisNeg ? -vN_vE[inAxis] : vN_vE[inAxis];
+		for (y = 0; y < tileHeight; y++)
+			for (x = 0; x < tileWidth; x++)
+				convolveCubemapToPixel(outData, outRes, outNumMips, encodeOutPixel(outRes, outFace, outMipNum, outX + x, outY + y), inDataFP32, width, height, simSamples);
+		return;
+	}
+
+	const mipPlan_t *plan = &mipPlans[outMipNum];
+	float roughness = plan->roughness;
+	float minNL = plan->minNL;
 
-		// use importance sampling equation to use smaller area
-		float minNL = 0.0f;
-		if (simSamples)
+	getPlanSource(plan, &inDataFP32, &width, &height);
+
+	for (i = 0, y = 0; y < tileHeight; y++)
+	{
+		for (x = 0; x < tileWidth; x++, i++)
 		{
-			float alpha = roughness * roughness;
-			float aa = alpha * alpha;
-			float lastSample = (float)simSamples / (float)(simSamples + 1);
-			minNL = sqrt((1.0 - lastSample)/((aa - 1.0f) * lastSample + 1.0f));
+			genPlanNorm(vN_vE[i], plan, outX + x, outY + y, outFace);
+			Vec3Set(color[i], 0.0f, 0.0f, 0.0f);
+			weightAccum[i] = 0.0f;
 		}
-		
-		convolveFaceToVector(faceColor, &faceWeightAccum, vN_vE_FaceSpace, inDataFP32, inFace, width, height, roughness, minNL);
-		Vec3Add(color, color, faceColor);
-		weightAccum += faceWeightAccum;
 	}
 
-	if (weightAccum)
-		weightAccum = 1.0f / weightAccum;
+	// rows per chunk, from the size of a row in the FP32 planar layout
+	// the 16 bit layouts leave more of L2 to spare
+	int chunkRows = MAX(1, SCHEDULE_CHUNK_BYTES / (((width + 15) & ~15) * 5 * (int)sizeof(float)));
 
-	Vec3Scale(color, weightAccum, color);
-	
-	outPixel[0] = ryg_float_to_srgb8(color[0]);
-	outPixel[1] = ryg_float_to_srgb8(color[1]);
-	outPixel[2] = ryg_float_to_srgb8(color[2]);
+	int f;
+	for (f = 0; f < plan->numFaces[outFace]; f++)
+	{
+		int inFace = plan->faces[outFace][f];
+		int startY = height, endY = 0;
+
+		for (i = 0; i < numPixels; i++)
+		{
+			transformToFaceSpace(vN_vE_FaceSpace[i], vN_vE[i], inFace);
+
+			if (calcValidRows(vN_vE_FaceSpace[i], width, height, minNL, &validY[i][0], &validY[i][1]))
+			{
+				startY = MIN(startY, validY[i][0]);
+				endY = MAX(endY, validY[i][1]);
+			}
+			else
+			{
+				validY[i][0] = validY[i][1] = 0;
+			}
+		}
+
+		int chunkY;
+		for (chunkY = startY; chunkY < endY; chunkY += chunkRows)
+		{
+			rowWindowBegin = chunkY;
+			rowWindowEnd = chunkY + chunkRows;
+
+			for (i = 0; i < numPixels;)
+			{
+				float faceColor[CONVOLVE_BLOCK_MAX][3];
+				float faceWeightAccum[CONVOLVE_BLOCK_MAX];
+				int numVectors = MIN(MAX(blockSize, 1), tileWidth - i % tileWidth);
+				int j, visible = 0;
+
+				// skip blocks with no valid rows in this chunk
+				for (j = i; j < i + numVectors; j++)
+					visible |= validY[j][0] < rowWindowEnd && validY[j][1] > rowWindowBegin;
+
+				if (visible)
+				{
+					if (numVectors > 1)
+						convolveFaceToVectors(faceColor, faceWeightAccum, &vN_vE_FaceSpace[i], numVectors, inDataFP32, inFace, width, height, roughness, minNL);
+					else
+						convolveFaceToVector(faceColor[0], &faceWeightAccum[0], vN_vE_FaceSpace[i], inDataFP32, inFace, width, height, roughness, minNL);
+
+					for (j = 0; j < numVectors; j++)
+					{
+						Vec3Add(color[i + j], color[i + j], faceColor[j]);
+						weightAccum[i + j] += faceWeightAccum[j];
+					}
+				}
+
+				i += numVectors;
+			}
+		}
+
+		rowWindowBegin = 0;
+		rowWindowEnd = 0x7fffffff;
+	}
+
+	for (i = 0, y = 0; y < tileHeight; y++)
+	{
+		uint8_t *outPixel = outData + encodeOutPixel(outRes, outFace, outMipNum, outX, outY + y) * 4;
+
+		for (x = 0; x < tileWidth; x++, i++, outPixel += 4)
+		{
+			if (weightAccum[i])
+				weightAccum[i] = 1.0f / weightAccum[i];
+
+			Vec3Scale(color[i], weightAccum[i], color[i]);
+
+			outPixel[0] = ryg_float_to_srgb8(color[i][0]);
+			outPixel[1] = ryg_float_to_srgb8(color[i][1]);
+			outPixel[2] = ryg_float_to_srgb8(color[i][2]);
+			outPixel[3] = 255;
+		}
+	}
+}
+
+void convolveCubemapToTileRange(uint8_t *outData, int outRes, int outNumMips, int begin, int end, int tileSize, int blockSize, float *inDataFP32, int width, int height, int simSamples)
+{
+	int i;
+
+	for (i = begin; i < end; i++)
+		convolveCubemapToTile(outData, outRes, outNumMips, i, tileSize, blockSize, inDataFP32, width, height, simSamples);
+}
+
+// ***
+// Work items
+// ***
+//
+// The output is handed to threads as a table of square tiles, each within one
+// face and mip, so a range of items never straddles mips and no pixel index
+// has to be decoded.  Texels in a tile are visited in Morton order, so blocks
+// of pixels convolved together, and pixels run back to back, point in nearby
+// directions and read the same input rows.
+//
+// A pixel of a rough mip costs thousands of times more than one of the first
+// mip, so items are cut into partitions of equal estimated cost rather than
+// equal count, one per scheduler partition.  The estimate is the fraction of
+// the sphere within the cutoff times the texels of the source level, which
+// undercounts plane culling a little.  Mips are issued most expensive first,
+// and their tiles are split into quadrants until none is more than a small
+// share of the total, so the last items to run are short.
+//
+// The last mips have too few pixels to go around the threads, and a single
+// pixel can be over that share too.  These pixels are sliced by input face
+// and range of rows, the kernels seeing a slice through rowWindowBegin/End,
+// and each slice keeps its sums apart.  Once all items are done the slices of
+// each pixel are added up in order.  The split doesn't depend on the number
+// of threads, so neither do the blocks of pixels convolved together, the
+// slices, the order they're added up in, or the results.
+
+#define WORK_ITEM_SIZE 8
+#define WORK_ITEM_SPLIT 4096
+#define WORK_SLICE_SPLIT 65536
+#define WORK_SLICE_PIXELS 96
+
+typedef struct
+{
+	int face, mip;
+	int x, y, size;		// corner and side of the tile, a power of 2
+	int firstPixel;		// index of texel 0, 0 of the face and mip
+	float cost;
+	int slice;			// -1 for a tile, else a slice of one pixel
+	int inFace, rowBegin, rowEnd;
+}
+workItem_t;
+
+workItem_t *workItems = NULL;
+int numWorkItems = 0;
+int workItemCapacity = 0;
+
+// pixels split into slices, and the sums of each slice
+typedef struct
+{
+	int face, mip, x, y, firstPixel;
+	int firstSlice, numSlices;
+}
+slicedPixel_t;
+
+slicedPixel_t *slicedPixels = NULL;
+int numSlicedPixels = 0;
+int slicedPixelCapacity = 0;
+float (*sliceSums)[4] = NULL;
+int numSlices = 0;
+
+int *workPartitions = NULL;	// first item of each partition, and numWorkItems
+int numWorkPartitions = 0;
+
+// estimated input texels read per pixel of a mip
+float estimateTexelCost(int mip, int outNumMips, int width)
+{
+	const mipPlan_t *plan = &mipPlans[mip];
+	float cost;
+
+	if (isDerivedMip(mip, outNumMips) || shMipEnabled[mip])
+		return 1.0f;
+
+	if (plan->sourceLevel >= 0)
+		width = sourceLevelRes[plan->sourceLevel];
+
+	cost = (1.0f - plan->minNL) * 0.5f * 6.0f * width * width;
+
+	// grid pixels only, cells are filled in later
+	if (sparseMip[mip])
+		cost /= sparseStep * sparseStep;
+
+	return MAX(cost, 1.0f);
+}
+
+// only pixels convolved face by face with the kernels
+static inline int isSliceableMip(int mip, int outNumMips)
+{
+	return !isDerivedMip(mip, outNumMips) && !shMipEnabled[mip] && !smallLobeMip[mip] && !sparseMip[mip] && !importanceSamples && !tileEpsilon;
+}
+
+workItem_t *appendWorkItem(void)
+{
+	if (numWorkItems == workItemCapacity)
+	{
+		workItemCapacity = MAX(workItemCapacity * 2, 1024);
+		workItems = realloc(workItems, workItemCapacity * sizeof(*workItems));
+	}
+
+	return &workItems[numWorkItems++];
+}
+
+// slice a pixel by input face and rows, into items of at most about sliceCost
+void addPixelSlices(int face, int mip, int x, int y, int firstPixel, int height, float texelCost, float sliceCost)
+{
+	const mipPlan_t *plan = &mipPlans[mip];
+	slicedPixel_t *pixel;
+	int f, i;
+
+	if (numSlicedPixels == slicedPixelCapacity)
+	{
+		slicedPixelCapacity = MAX(slicedPixelCapacity * 2, 64);
+		slicedPixels = realloc(slicedPixels, slicedPixelCapacity * sizeof(*slicedPixels));
+	}
+
+	pixel = &slicedPixels[numSlicedPixels++];
+	pixel->face = face;
+	pixel->mip = mip;
+	pixel->x = x;
+	pixel->y = y;
+	pixel->firstPixel = firstPixel;
+	pixel->firstSlice = numSlices;
+	pixel->numSlices = 0;
+
+	float faceCost = texelCost / plan->numFaces[face];
+	int numRowSlices = CLAMP((int)ceilf(faceCost / sliceCost), 1, height);
+
+	for (f = 0; f < plan->numFaces[face]; f++)
+	{
+		for (i = 0; i < numRowSlices; i++)
+		{
+			workItem_t *item = appendWorkItem();
+
+			item->face = face;
+			item->mip = mip;
+			item->x = x;
+			item->y = y;
+			item->size = 1;
+			item->firstPixel = firstPixel;
+			item->cost = faceCost / numRowSlices;
+			item->slice = numSlices++;
+			item->inFace = plan->faces[face][f];
+			item->rowBegin = i * height / numRowSlices;
+			item->rowEnd = (i + 1) * height / numRowSlices;
+			pixel->numSlices++;
+		}
+	}
+}
+
+// add a tile, or its quadrants in Morton order if it costs more than maxCost
+// pixels are sliced if sliceHeight is set
+void addWorkItem(int face, int mip, int x, int y, int size, int firstPixel, float texelCost, float maxCost, int sliceHeight, float sliceCost)
+{
+	int mipRes = mipPlans[mip].mipRes;
+	workItem_t *item;
+
+	if (x >= mipRes || y >= mipRes)
+		return;
+
+	float cost = MIN(size, mipRes - x) * MIN(size, mipRes - y) * texelCost;
+
+	if (size == 1 && cost > maxCost && sliceHeight)
+	{
+		addPixelSlices(face, mip, x, y, firstPixel, sliceHeight, texelCost, sliceCost);
+		return;
+	}
+
+	if (size > 1 && cost > maxCost)
+	{
+		int half = size / 2;
+
+		addWorkItem(face, mip, x, y, half, firstPixel, texelCost, maxCost, sliceHeight, sliceCost);
+		addWorkItem(face, mip, x + half, y, half, firstPixel, texelCost, maxCost, sliceHeight, sliceCost);
+		addWorkItem(face, mip, x, y + half, half, firstPixel, texelCost, maxCost, sliceHeight, sliceCost);
+		addWorkItem(face, mip, x + half, y + half, half, firstPixel, texelCost, maxCost, sliceHeight, sliceCost);
+		return;
+	}
+
+	item = appendWorkItem();
+	item->face = face;
+	item->mip = mip;
+	item->x = x;
+	item->y = y;
+	item->size = size;
+	item->firstPixel = firstPixel;
+	item->cost = cost;
+	item->slice = -1;
+}
+
+void buildWorkItems(int outRes, int outNumMips, int width, int numPartitions)
+{
+	float texelCost[MIP_PLANS_MAX];
+	int mipOrder[MIP_PLANS_MAX];
+	double totalCost = 0.0, cost = 0.0;
+	int face, mip, i, j, x, y;
+
+	for (mip = 0; mip < outNumMips; mip++)
+	{
+		int mipRes = mipPlans[mip].mipRes;
+
+		texelCost[mip] = estimateTexelCost(mip, outNumMips, width);
+		totalCost += 6.0 * mipRes * mipRes * texelCost[mip];
+
+		// insertion sort, most expensive pixels first
+		for (i = mip; i > 0 && texelCost[mipOrder[i - 1]] < texelCost[mip]; i--)
+			mipOrder[i] = mipOrder[i - 1];
+		mipOrder[i] = mip;
+	}
+
+	float maxCost = totalCost / WORK_ITEM_SPLIT;
+	float sliceCost = totalCost / WORK_SLICE_SPLIT;
+
+	numWorkItems = 0;
+	numSlicedPixels = 0;
+	numSlices = 0;
+	for (i = 0; i < outNumMips; i++)
+	{
+		int mipRes, sliceHeight = 0;
+		float mipMaxCost = maxCost;
+		int size = 1;
+
+		mip = mipOrder[i];
+		mipRes = mipPlans[mip].mipRes;
+
+		while (size < MIN(mipRes, WORK_ITEM_SIZE))
+			size <<= 1;
+
+		// rows of the input level the mip reads from
+		if (isSliceableMip(mip, outNumMips))
+			sliceHeight = (mipPlans[mip].sourceLevel >= 0) ? sourceLevelRes[mipPlans[mip].sourceLevel] : width;
+
+		// too few pixels to keep the threads busy, so slice every one
+		if (sliceHeight && 6 * mipRes * mipRes <= WORK_SLICE_PIXELS)
+			mipMaxCost = 0.0f;
+
+		for (face = 0; face < 6; face++)
+		{
+			int firstPixel = encodeOutPixel(outRes, face, mip, 0, 0);
+
+			for (y = 0; y < mipRes; y += size)
+				for (x = 0; x < mipRes; x += size)
+					addWorkItem(face, mip, x, y, size, firstPixel, texelCost[mip], mipMaxCost, sliceHeight, sliceCost);
+		}
+	}
+
+	// cut at even shares of the total cost
+	workPartitions = realloc(workPartitions, (numPartitions + 1) * sizeof(*workPartitions));
+	workPartitions[0] = 0;
+	for (i = 0, j = 1; i < numWorkItems && j < numPartitions; i++)
+	{
+		cost += workItems[i].cost;
+		while (j < numPartitions && cost >= totalCost * j / numPartitions)
+			workPartitions[j++] = i + 1;
+	}
+	while (j <= numPartitions)
+		workPartitions[j++] = numWorkItems;
+
+	numWorkPartitions = numPartitions;
+
+	sliceSums = realloc(sliceSums, MAX(numSlices, 1) * sizeof(*sliceSums));
+
+	printf("Split the output into %d work items, in %d partitions by estimated cost.\n", numWorkItems, numWorkPartitions);
+	if (numSlicedPixels)
+		printf("Split %d pixels into %d slices by input face and rows.\n", numSlicedPixels, numSlices);
+}
+
+// sums of one slice of a pixel
+void convolveWorkSlice(const workItem_t *item, float *inDataFP32, int width, int height)
+{
+	const mipPlan_t *plan = &mipPlans[item->mip];
+	float vN_vE[4], vN_vE_FaceSpace[4];
+	float *sums = sliceSums[item->slice];
+
+	getPlanSource(plan, &inDataFP32, &width, &height);
+
+	genPlanNorm(vN_vE, plan, item->x, item->y, item->face);
+	transformToFaceSpace(vN_vE_FaceSpace, vN_vE, item->inFace);
+
+	rowWindowBegin = item->rowBegin;
+	rowWindowEnd = item->rowEnd;
+
+	sums[3] = 0.0f;
+	convolveFaceToVector(sums, &sums[3], vN_vE_FaceSpace, inDataFP32, item->inFace, width, height, plan->roughness, plan->minNL);
+
+	rowWindowBegin = 0;
+	rowWindowEnd = 0x7fffffff;
+}
+
+// add up the slices of each pixel in order, after all items are done
+void reduceSlicedPixels(uint8_t *outData)
+{
+	int i, j;
+
+	for (i = 0; i < numSlicedPixels; i++)
+	{
+		const slicedPixel_t *pixel = &slicedPixels[i];
+		uint8_t *outPixel = outData + (pixel->firstPixel + pixel->y * mipPlans[pixel->mip].mipRes + pixel->x) * 4;
+		float color[3] = {0.0f, 0.0f, 0.0f};
+		float weightAccum = 0.0f;
+
+		for (j = pixel->firstSlice; j < pixel->firstSlice + pixel->numSlices; j++)
+		{
+			Vec3Add(color, color, sliceSums[j]);
+			weightAccum += sliceSums[j][3];
+		}
+
+		if (weightAccum)
+			weightAccum = 1.0f / weightAccum;
+
+		Vec3Scale(color, weightAccum, color);
+
+		outPixel[0] = ryg_float_to_srgb8(color[0]);
+		outPixel[1] = ryg_float_to_srgb8(color[1]);
+		outPixel[2] = ryg_float_to_srgb8(color[2]);
+		outPixel[3] = 255;
+	}
+}
+
+// texel of a tile at a position along its Morton curve
+static inline void decodeMorton(int code, int *outX, int *outY)
+{
+	int i;
+
+	*outX = *outY = 0;
+	for (i = 0; code >> (i * 2); i++)
+	{
+		*outX |= ((code >> (i * 2)) & 1) << i;
+		*outY |= ((code >> (i * 2 + 1)) & 1) << i;
+	}
+}
+
+// convolve the pixels of an item in blocks of up to blockSize pixels
+void convolveWorkItem(uint8_t *outData, int outNumMips, const workItem_t *item, int blockSize, float *inDataFP32, int width, int height, int simSamples)
+{
+	uint8_t *outMip = outData + item->firstPixel * 4;
+	int mipRes = mipPlans[item->mip].mipRes;
+	int pixelXY[CONVOLVE_BLOCK_MAX][2];
+	int numPixels = 0;
+	int i, x, y;
+
+	if (item->slice >= 0)
+	{
+		convolveWorkSlice(item, inDataFP32, width, height);
+		return;
+	}
+
+	// spherical harmonic, derived, small lobe and sparse mips are done per pixel
+	if (shMipEnabled[item->mip] || isDerivedMip(item->mip, outNumMips) || smallLobeMip[item->mip] || sparseMip[item->mip])
+		blockSize = 1;
+
+	for (i = 0; i < item->size * item->size; i++)
+	{
+		decodeMorton(i, &x, &y);
+		x += item->x;
+		y += item->y;
+
+		if (x >= mipRes || y >= mipRes)
+			continue;
+
+		if (blockSize <= 1)
+		{
+			convolveCubemapToTexel(outMip, outNumMips, item->face, item->mip, x, y, inDataFP32, width, height, simSamples);
+			continue;
+		}
+
+		pixelXY[numPixels][0] = x;
+		pixelXY[numPixels][1] = y;
+
+		if (++numPixels == blockSize)
+		{
+			convolveCubemapToTexels(outMip, item->face, item->mip, numPixels, pixelXY, inDataFP32, width, height);
+			numPixels = 0;
+		}
+	}
+
+	if (numPixels)
+		convolveCubemapToTexels(outMip, item->face, item->mip, numPixels, pixelXY, inDataFP32, width, height);
+}
+
+void convolveWorkItemRange(uint8_t *outData, int outNumMips, int begin, int end, int blockSize, float *inDataFP32, int width, int height, int simSamples)
+{
+	int i;
+
+	for (i = begin; i < end; i++)
+		convolveWorkItem(outData, outNumMips, &workItems[i], blockSize, inDataFP32, width, height, simSamples);
+}
+
+// the second pass of sparse evaluation, after the grid has been convolved
+
+static void interpolateSparsePixel(uint8_t *outPixel, float corners[4][3], float fx, float fy)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		float top = corners[0][i] + (corners[1][i] - corners[0][i]) * fx;
+		float bottom = corners[2][i] + (corners[3][i] - corners[2][i]) * fx;
+		outPixel[i] = ryg_float_to_srgb8(top + (bottom - top) * fy);
+	}
 	outPixel[3] = 255;
 }
 
+// fill in the pixels a cell owns, returns the number of them convolved
+int fillSparseCell(uint8_t *outData, int outRes, int outNumMips, int cellIndex, float *inDataFP32, int width, int height, int simSamples)
+{
+	int outFace, outMipNum, outMipRes, x0, y0, x1, y1, x, y, i;
+	float corners[4][3];
+
+	decodeSparseCell(outRes, outNumMips, cellIndex, &outFace, &outMipNum, &outMipRes, &x0, &y0, &x1, &y1);
+
+	// cells own their top and left edges, and the last cells the bottom and right ones too
+	int endX = x1 == outMipRes - 1 ? outMipRes : x1;
+	int endY = y1 == outMipRes - 1 ? outMipRes : y1;
+
+	// nothing between the corners
+	int checkX = (x0 + x1) / 2, checkY = (y0 + y1) / 2;
+	if (isSparseGridCoord(checkX, outMipRes) && isSparseGridCoord(checkY, outMipRes))
+		return 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		uint8_t *corner = outData + encodeOutPixel(outRes, outFace, outMipNum, (i & 1) ? x1 : x0, (i & 2) ? y1 : y0) * 4;
+		Vec3Set(corners[i], ryg_srgb8_to_float(corner[0]), ryg_srgb8_to_float(corner[1]), ryg_srgb8_to_float(corner[2]));
+	}
+
+	float scaleX = 1.0f / (x1 - x0);
+	float scaleY = 1.0f / (y1 - y0);
+	int checkPixelCount = encodeOutPixel(outRes, outFace, outMipNum, checkX, checkY);
+	uint8_t *checkPixel = outData + checkPixelCount * 4;
+	uint8_t interpolated[4];
+
+	interpolateSparsePixel(interpolated, corners, (checkX - x0) * scaleX, (checkY - y0) * scaleY);
+	convolveCubemapToPixel(outData, outRes, outNumMips, checkPixelCount, inDataFP32, width, height, simSamples);
+
+	int refine = 0;
+	for (i = 0; i < 3; i++)
+		refine |= abs(checkPixel[i] - interpolated[i]) > SPARSE_MAX_ERROR;
+
+	int numConvolved = 1;
+	for (y = y0; y < endY; y++)
+	{
+		for (x = x0; x < endX; x++)
+		{
+			int outPixelCount = encodeOutPixel(outRes, outFace, outMipNum, x, y);
+
+			if (outPixelCount == checkPixelCount || (isSparseGridCoord(x, outMipRes) && isSparseGridCoord(y, outMipRes)))
+				continue;
+
+			if (refine)
+			{
+				convolveCubemapToPixel(outData, outRes, outNumMips, outPixelCount, inDataFP32, width, height, simSamples);
+				numConvolved++;
+			}
+			else
+				interpolateSparsePixel(outData + outPixelCount * 4, corners, (x - x0) * scaleX, (y - y0) * scaleY);
+		}
+	}
+
+	return numConvolved;
+}
+
+void fillSparseCellRange(uint8_t *outData, int outRes, int outNumMips, int begin, int end, int *numConvolved, float *inDataFP32, int width, int height, int simSamples)
+{
+	int i;
+
+	for (i = begin; i < end; i++)
+		numConvolved[i] = fillSparseCell(outData, outRes, outNumMips, i, inDataFP32, width, height, simSamples);
+}
+
+// report per mip how many pixels were convolved, and how many cells had to be
+void reportSparseCoverage(int outRes, int outNumMips, int *numConvolved)
+{
+	int cellIndex = 0, i, j;
+
+	for (i = 0; i < outNumMips && i < OUTPUT_MIPS_MAX; i++)
+	{
+		if (!sparseMip[i])
+			continue;
+
+		int mipRes = outRes >> i;
+		int gridSize = calcSparseGridSize(mipRes);
+		int numCells = (gridSize - 1) * (gridSize - 1) * 6;
+		int numPixels = mipRes * mipRes * 6;
+		int mipConvolved = gridSize * gridSize * 6;
+		int numRefined = 0;
+
+		for (j = 0; j < numCells; j++, cellIndex++)
+		{
+			mipConvolved += numConvolved[cellIndex];
+			numRefined += numConvolved[cellIndex] > 1;
+		}
+
+		printf("  mip %d: convolved %d of %d pixels (%.1f%%), refined %d of %d cells\n", i, mipConvolved, numPixels, 100.0f * mipConvolved / numPixels, numRefined, numCells);
+	}
+}
+
 struct convolveInfo
 {
 	uint8_t  *outData;
@@ -603,20 +6097,52 @@ struct convolveInfo
 	int inWidth;
 	int inHeight;
 	int simSamples;
+	int blockSize;
+	int tileSize;
+	int *numConvolved;
+	int numMaps;
+	int outNumPixels;
 };
 
-void convolveCubemapToPixelThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
+void convolveWorkItemThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
+{
+	struct convolveInfo *info = pArg;
+
+	convolveWorkItemRange(info->outData, info->outNumMips, workPartitions[begin], workPartitions[end], info->blockSize, info->inDataFP32, info->inWidth, info->inHeight, info->simSamples);
+}
+
+void convolveCubemapToTileThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
+{
+	struct convolveInfo *info = pArg;
+
+	convolveCubemapToTileRange(info->outData, info->outRes, info->outNumMips, begin, end, info->tileSize, info->blockSize, info->inDataFP32, info->inWidth, info->inHeight, info->simSamples);
+}
+
+void convolveCubemapToPixelBatchThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
+{
+	struct convolveInfo *info = pArg;
+
+	convolveCubemapToPixelBatchRange(info->outData, info->outRes, info->outNumMips, info->outNumPixels, begin, end, info->inDataFP32, info->numMaps, info->inWidth, info->inHeight, info->simSamples);
+}
+
+void convolveCubemapToPixelMatrixThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
+{
+	struct convolveInfo *info = pArg;
+
+	convolveCubemapToPixelMatrixRange(info->outData, begin, end);
+}
+
+void fillSparseCellThreaded(void *pArg, struct scheduler *s, sched_uint begin, sched_uint end, sched_uint thread)
 {
 	struct convolveInfo *info = pArg;
 
-	sched_uint i;
-	for (i = begin; i < end; i++)
-		convolveCubemapToPixel(info->outData, info->outRes, info->outNumMips, i, info->inDataFP32, info->inWidth, info->inHeight, info->simSamples);
+	fillSparseCellRange(info->outData, info->outRes, info->outNumMips, begin, end, info->numConvolved, info->inDataFP32, info->inWidth, info->inHeight, info->simSamples);
 }
 
 int main(int argc, char *argv[])
 {
-	char *inFilename = NULL, *outFilename = NULL;
+	char *inFilenames[BATCH_MAX], *outFilenames[BATCH_MAX];
+	int numInputs = 0, numOutputs = 0;
 	unsigned char *inData;
 	ddsType_t type;
 	ddsFlags_t flags;
@@ -624,6 +6150,11 @@ int main(int argc, char *argv[])
 	int simSamples = 100;
 	int numThreads = SCHED_DEFAULT;
 	int detect = 1;
+	simdLevel_t simd = SIMD_NONE;
+	int planar = 1;
+	int blockSize = 8;
+	inputPrecision_t precision = PRECISION_FP32;
+	int badOption = 0;
 
 	printf("\nGGXCC: GGX cube map convolver for ioquake3's OpenGL2 renderer\n");
 	
@@ -632,9 +6163,19 @@ int main(int argc, char *argv[])
 	{
 		if (argv[arg][0] == '-')
 		{
-			if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
+			if (strcmp(argv[arg], "--preview") == 0)
+			{
+				previewMode = 1;
+				printf("Using the preview engine.\n");
+			}
+			else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
 			{
-				outFilename = argv[arg + 1];
+				if (numOutputs == BATCH_MAX)
+				{
+					printf("Error! At most %d output files.\n", BATCH_MAX);
+					return 0;
+				}
+				outFilenames[numOutputs++] = argv[arg + 1];
 				arg++;
 			}
 			else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
@@ -650,20 +6191,237 @@ int main(int argc, char *argv[])
 			}
 			else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
 			{
-				if (strcmp(argv[arg+1], "on") == 0)
+#ifdef GGXCC_AVX512
+				if (strcmp(argv[arg+1], "avx512") == 0)
+				{
+					simd = SIMD_AVX512;
+					printf("AVX-512 enabled.\n");
+					detect = 0;
+				}
+				else
+#endif
+				if (strcmp(argv[arg+1], "avx2") == 0)
+				{
+					simd = SIMD_AVX2;
+					printf("AVX2 enabled.\n");
+					detect = 0;
+				}
+				else if (strcmp(argv[arg+1], "sse2") == 0 || strcmp(argv[arg+1], "on") == 0)
 				{
-					convolveFaceToVector = convolveFaceToVectorSSE2;
-					formatDataForConvolution = formatDataForConvolutionSSE2;
+					simd = SIMD_SSE2;
 					printf("SSE2 enabled.\n");
 					detect = 0;
 				}
 				else if (strcmp(argv[arg+1], "off") == 0)
 				{
-					convolveFaceToVector = convolveFaceToVectorScalar;
-					formatDataForConvolution = formatDataForConvolutionScalar;
-					printf("SSE2 disabled.\n");
+					simd = SIMD_NONE;
+					printf("SIMD disabled.\n");
 					detect = 0;
 				}
+				else if (strcmp(argv[arg+1], "auto") == 0)
+				{
+					detect = 1;
+				}
+				else
+					badOption = 1;
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-l") == 0 && arg + 1 < argc)
+			{
+				if (strcmp(argv[arg+1], "planar") == 0)
+				{
+					planar = 1;
+					printf("Using planar layout.\n");
+				}
+				else if (strcmp(argv[arg+1], "grouped") == 0)
+				{
+					planar = 0;
+					printf("Using grouped layout.\n");
+				}
+				else
+					badOption = 1;
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc)
+			{
+				if (strcmp(argv[arg+1], "int16") == 0)
+				{
+					precision = PRECISION_INT16;
+					printf("Using INT16 input data.\n");
+				}
+				else if (strcmp(argv[arg+1], "fp16") == 0)
+				{
+					precision = PRECISION_FP16;
+					printf("Using FP16 input data.\n");
+				}
+				else if (strcmp(argv[arg+1], "fp32") == 0)
+				{
+					precision = PRECISION_FP32;
+					printf("Using FP32 input data.\n");
+				}
+				else
+					badOption = 1;
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc)
+			{
+				lobeEnergyCutoff = atof(argv[arg + 1]);
+				if (lobeEnergyCutoff < 0.0f || lobeEnergyCutoff >= 1.0f)
+				{
+					printf("Error! Energy fraction must be >= 0 and < 1.\n");
+					return 0;
+				}
+				if (lobeEnergyCutoff == 0.0f)
+					printf("Culling texels by simulated samples.\n");
+				else
+					printf("Culling texels by lobe energy, dropping up to %g.\n", lobeEnergyCutoff);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+			{
+				if (strcmp(argv[arg+1], "conic") == 0)
+				{
+					conicCulling = 1;
+					printf("Culling texels outside the exact lobe.\n");
+				}
+				else if (strcmp(argv[arg+1], "plane") == 0)
+				{
+					conicCulling = 0;
+					printf("Culling texels behind the lobe plane.\n");
+				}
+				else
+					badOption = 1;
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-e") == 0 && arg + 1 < argc)
+			{
+				tileEpsilon = atof(argv[arg + 1]);
+				if (tileEpsilon < 0.0f)
+				{
+					printf("Error! Tile epsilon must be >= 0.\n");
+					return 0;
+				}
+				if (tileEpsilon == 0.0f)
+					printf("Not using tile culling.\n");
+				else
+					printf("Using tile culling, epsilon %g.\n", tileEpsilon);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-g") == 0 && arg + 1 < argc)
+			{
+				importanceSamples = atoi(argv[arg + 1]);
+				if (importanceSamples < 0)
+				{
+					printf("Error! Number of importance samples must be >= 0.\n");
+					return 0;
+				}
+				if (importanceSamples == 0)
+					printf("Not using importance sampling.\n");
+				else
+					printf("Using importance sampling, %d samples.\n", importanceSamples);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc)
+			{
+				smallLobeRadius = atoi(argv[arg + 1]);
+				if (smallLobeRadius < 0)
+				{
+					printf("Error! Small lobe radius must be >= 0.\n");
+					return 0;
+				}
+				if (smallLobeRadius == 0)
+					printf("Not using the small lobe fast path.\n");
+				else
+					printf("Using the small lobe fast path for lobes up to %d texels.\n", smallLobeRadius);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc)
+			{
+				matrixCacheDir = argv[arg + 1];
+				printf("Caching the convolution matrix in %s.\n", matrixCacheDir);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc)
+			{
+				sparseStep = atoi(argv[arg + 1]);
+				if (sparseStep < 0 || sparseStep == 1)
+				{
+					printf("Error! Sparse step must be 0 or at least 2.\n");
+					return 0;
+				}
+				if (sparseStep == 0)
+					printf("Not using sparse evaluation.\n");
+				else
+					printf("Evaluating wide lobe mips every %d pixels.\n", sparseStep);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+			{
+				if (strcmp(argv[arg+1], "on") == 0)
+				{
+					reuseRoughMips = 1;
+					printf("Deriving the last two mips from the first roughness 1 mip.\n");
+				}
+				else if (strcmp(argv[arg+1], "off") == 0)
+				{
+					reuseRoughMips = 0;
+					printf("Convolving all roughness 1 mips.\n");
+				}
+				else
+					badOption = 1;
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-z") == 0 && arg + 1 < argc)
+			{
+				shOrder = atoi(argv[arg + 1]);
+				if (shOrder < 0 || shOrder > SH_ORDER_MAX - 1)
+				{
+					printf("Error! Spherical harmonic order must be between 0 and %d.\n", SH_ORDER_MAX - 1);
+					return 0;
+				}
+				if (shOrder == 0)
+					printf("Not using spherical harmonics.\n");
+				else
+					printf("Using order %d spherical harmonics for rough mips.\n", shOrder);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc)
+			{
+				sourceLodFraction = atof(argv[arg + 1]);
+				if (sourceLodFraction < 0.0f)
+				{
+					printf("Error! Source level fraction must be >= 0.\n");
+					return 0;
+				}
+				if (sourceLodFraction == 0.0f)
+					printf("Convolving all mips from the full input.\n");
+				else
+					printf("Convolving from input levels with texels up to %g of the lobe width.\n", sourceLodFraction);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-x") == 0 && arg + 1 < argc)
+			{
+				scheduleTileSize = atoi(argv[arg + 1]);
+				if (scheduleTileSize < 0 || scheduleTileSize > SCHEDULE_TILE_MAX)
+				{
+					printf("Error! Output tile size must be between 0 and %d.\n", SCHEDULE_TILE_MAX);
+					return 0;
+				}
+				if (scheduleTileSize == 0)
+					printf("Not using the cache-blocked schedule.\n");
+				else
+					printf("Convolving %dx%d pixel output tiles.\n", scheduleTileSize, scheduleTileSize);
+				arg++;
+			}
+			else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc)
+			{
+				blockSize = atoi(argv[arg + 1]);
+				if (blockSize <= 0 || blockSize > CONVOLVE_BLOCK_MAX)
+				{
+					printf("Error! Block size must be between 1 and %d.\n", CONVOLVE_BLOCK_MAX);
+					return 0;
+				}
+				printf("Convolving %d pixels per block.\n", blockSize);
 				arg++;
 			}
 			else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
@@ -681,43 +6439,224 @@ int main(int argc, char *argv[])
 				arg++;
 			}
 		}
-		else if (!inFilename)
-			inFilename = argv[arg];
+		else if (numInputs < BATCH_MAX)
+			inFilenames[numInputs++] = argv[arg];
+		else
+		{
+			printf("Error! At most %d input files.\n", BATCH_MAX);
+			return 0;
+		}
 	}
+
+	char *inFilename = numInputs ? inFilenames[0] : NULL;
+	char *outFilename = numOutputs ? outFilenames[0] : "output.dds";
 	
 	unsigned int cpuInfo[4];
 
-#if !defined(_MSC_VER)
-	__cpuid(1, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3]);
-#else
-    __cpuid(cpuInfo, 1);
-#endif
+	getCpuid(cpuInfo, 0, 0);
+	unsigned int maxLeaf = cpuInfo[0];
 
-	unsigned int cpuInfo3 = cpuInfo[3];
+	getCpuid(cpuInfo, 1, 0);
+	int hasSSE2 = (cpuInfo[3] & (1 << 26)) != 0;
+
+	// AVX2 needs FMA, F16C, OS support for saving the YMM registers (OSXSAVE + XCR0), and leaf 7
+	// AVX-512 additionally needs OS support for the opmask and ZMM registers
+	int hasAVX2 = 0, hasAVX512 = 0;
+	if ((cpuInfo[2] & (1 << 12)) && (cpuInfo[2] & (1 << 27)) && (cpuInfo[2] & (1 << 28)) && (cpuInfo[2] & (1 << 29)) && maxLeaf >= 7)
+	{
+		uint64_t xcr0 = getXcr0();
+		if ((xcr0 & 0x06) == 0x06)
+		{
+			getCpuid(cpuInfo, 7, 0);
+			hasAVX2 = (cpuInfo[1] & (1 << 5)) != 0;
+			hasAVX512 = (cpuInfo[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+		}
+	}
 	
-	if (!inFilename)
+	if (!inFilename || badOption)
 	{
 		printf("Usage: %s [options] <input.dds> -o <output.dds>\n", argv[0]);
+		printf("       %s [options] <input.dds>... -o <output.dds>...\n", argv[0]);
 		printf("Available options:\n");
 		printf("  -o <output.dds>  - Set output filename.  Default is output.dds.\n");
+		printf("                     With several inputs, give one output per input.\n");
+		printf("                     Same size inputs are convolved as a batch, sharing\n");
+		printf("                     weights, with FP32 planar data and no other engines.\n");
 		printf("  -t <threads>     - Set number of threads.  Default is all.\n");
-		printf("  -s <on|off|auto> - Enable SSE2 optimizations.  Default is autodetect.\n");
+		printf("  --preview        - Approximate each mip with a Gaussian blur, in a\n");
+		printf("                     fraction of the time.  Other options are ignored.\n");
+		printf("  -s <avx512|avx2|sse2|off|auto>\n");
+		printf("                   - Select SIMD optimizations.  Default is autodetect.\n");
+		printf("  -l <planar|grouped>\n");
+		printf("                   - Select SIMD data layout.  Default is planar.\n");
+		printf("  -p <fp32|fp16|int16>\n");
+		printf("                   - Set precision of the input data.  FP16 uses 8 bytes\n");
+		printf("                     per texel and INT16 uses 6, instead of 20.\n");
+		printf("                     INT16 uses the integer kernel.  Default is fp32.\n");
+		printf("  -b <pixels>      - Convolve up to this many neighbouring pixels per pass\n");
+		printf("                     over the input, 1-%d.  Default is 8.\n", CONVOLVE_BLOCK_MAX);
 		printf("  -i <samples>     - Simulate importance sampling for speedup.\n");
 		printf("                     Disable with 0.  Default is 100.\n");
+		printf("  -f <fraction>    - Instead of simulated samples, cull each lobe where it\n");
+		printf("                     holds at most this fraction of its energy, for\n");
+		printf("                     example 0.01, and report the cutoff of each mip.\n");
+		printf("                     Default is 0, off.\n");
+		printf("  -c <plane|conic> - Set how simulated importance sampling culls texels.\n");
+		printf("                     Conic visits only the exact lobe, which is faster,\n");
+		printf("                     but drops more of its tail for the same samples.\n");
+		printf("                     Default is plane.\n");
+		printf("  -e <epsilon>     - Use hierarchical tile culling instead of simulated\n");
+		printf("                     importance sampling.  Tiles whose weight varies by at\n");
+		printf("                     most epsilon of the total use their aggregate, for\n");
+		printf("                     example 0.01.  Uses FP32 planar input data, and\n");
+		printf("                     convolves one pixel per pass.  Default is 0, off.\n");
+		printf("  -g <samples>     - Use importance sampling with this many samples per\n");
+		printf("                     pixel instead of convolving texels, for example 256.\n");
+		printf("                     Samples are filtered from input levels by their pdf.\n");
+		printf("                     Default is 0, off.\n");
+		printf("  -w <texels>      - With conic culling, weight only a window around lobes\n");
+		printf("                     of up to this radius in texels, reading across face\n");
+		printf("                     seams.  Needs FP32 planar input data.  0 is off.\n");
+		printf("                     Default is 16.\n");
+		printf("  -k <directory>   - Cache the convolution as a sparse matrix in this\n");
+		printf("                     directory, per resolution, samples, culling and\n");
+		printf("                     cutoff, and reuse it on later runs.  Rows are shared\n");
+		printf("                     by symmetric pixels, with 16 bit weights.  Not used\n");
+		printf("                     with other engines or batches, or if the matrix\n");
+		printf("                     would pass 2^32 weights.  Default is off.\n");
+		printf("  -a <pixels>      - In mips whose lobe is at least this many pixels wide,\n");
+		printf("                     convolve every this many pixels, for example 4, and\n");
+		printf("                     interpolate the rest.  Cells whose center misses its\n");
+		printf("                     interpolation by more than %d level are convolved in\n", SPARSE_MAX_ERROR);
+		printf("                     full.  Reports coverage per mip.  Default is 0, off.\n");
+		printf("  -r <on|off>      - Derive the last two mips from the first mip with\n");
+		printf("                     roughness 1, instead of convolving them.  Turn off\n");
+		printf("                     for exact comparisons.  Default is on.\n");
+		printf("  -z <order>       - Reconstruct mips with a wide enough lobe from order\n");
+		printf("                     spherical harmonics of the input, 1-%d, for example\n", SH_ORDER_MAX - 1);
+		printf("                     8.  Default is 0, off.\n");
+		printf("  -m <fraction>    - Convolve each mip from the coarsest input level whose\n");
+		printf("                     texels are at most this fraction of the lobe width,\n");
+		printf("                     for example 0.25.  Uses mips from the input file if\n");
+		printf("                     present.  Default is 0, off.\n");
+		printf("  -x <pixels>      - Convolve the output in tiles of this many pixels\n");
+		printf("                     square, each walking the input in L2 sized chunks\n");
+		printf("                     of rows, 1-%d.  Default is 0, off.\n", SCHEDULE_TILE_MAX);
 		printf("\nOnly dds, 8-bit RGBA files are accepted as input.\n");
 		return 0;
 	}
 	
-	if (cpuInfo3 & (1 << 26) && detect)
+#ifdef GGXCC_AVX512
+	if (hasAVX512 && detect)
+	{
+		printf("AVX-512 autodetected.\n");
+		simd = SIMD_AVX512;
+	}
+	else
+#endif
+	if (hasAVX2 && detect)
+	{
+		printf("AVX2 autodetected.\n");
+		simd = SIMD_AVX2;
+	}
+	else if (hasSSE2 && detect)
 	{
 		printf("SSE2 autodetected.\n");
-		convolveFaceToVector = convolveFaceToVectorSSE2;
-		formatDataForConvolution = formatDataForConvolutionSSE2;
+		simd = SIMD_SSE2;
+	}
+
+	if (precision == PRECISION_FP16 && simd < SIMD_AVX2)
+	{
+		printf("FP16 input data needs AVX2 or AVX-512, using FP32 instead.\n");
+		precision = PRECISION_FP32;
+	}
+
+	if (precision == PRECISION_INT16 && simd < SIMD_AVX2)
+	{
+		printf("INT16 input data needs AVX2, using FP32 instead.\n");
+		precision = PRECISION_FP32;
+	}
+
+	selectConvolutionFuncs(simd, planar, precision);
+
+	if (matrixCacheDir && (numInputs > 1 || previewMode))
+	{
+		printf("Not using the convolution matrix with batches or the preview engine.\n");
+		matrixCacheDir = NULL;
+	}
+
+	// the matrix only holds the direct convolution
+	if (matrixCacheDir)
+	{
+		importanceSamples = 0;
+		shOrder = 0;
+		tileEpsilon = 0.0f;
+		sourceLodFraction = 0.0f;
+		scheduleTileSize = 0;
+		smallLobeRadius = 0;
+		sparseStep = 0;
+	}
+
+	// outputs pair up with inputs, except for the default name
+	if ((numInputs > 1 || numOutputs > 1) && numOutputs != numInputs)
+	{
+		printf("Error! Give one output file per input, got %d for %d.\n", numOutputs, numInputs);
+		return 0;
+	}
+
+	// batches only use the direct convolution
+	if (numInputs > 1)
+	{
+		printf("Convolving %d cubemaps as a batch, not using other engines.\n", numInputs);
+		previewMode = 0;
+		importanceSamples = 0;
+		shOrder = 0;
+		tileEpsilon = 0.0f;
+		sourceLodFraction = 0.0f;
+		scheduleTileSize = 0;
+		smallLobeRadius = 0;
+		sparseStep = 0;
+	}
+
+	if (previewMode)
+	{
+		importanceSamples = 0;
+		shOrder = 0;
+		tileEpsilon = 0.0f;
+		lobeEnergyCutoff = 0.0f;
+		reuseRoughMips = 0;
+	}
+
+	if (importanceSamples)
+	{
+		if (tileEpsilon || scheduleTileSize || sourceLodFraction)
+			printf("Importance sampling replaces tile culling, the cache-blocked schedule and input levels.\n");
+
+		tileEpsilon = 0.0f;
+		scheduleTileSize = 0;
+		sourceLodFraction = 0.0f;
+		blockSize = 1;
+	}
+
+	// tiles are built from, and fall back to, the FP32 planar layout
+	if (tileEpsilon)
+	{
+		formatDataForConvolution = formatDataForConvolutionPlanar;
+		blockSize = 1;
+
+		if (scheduleTileSize)
+		{
+			printf("Tile culling convolves all faces at once, not using the cache-blocked schedule.\n");
+			scheduleTileSize = 0;
+		}
+
+		if (sourceLodFraction)
+		{
+			printf("Tile culling builds tiles from the full input, not using input levels.\n");
+			sourceLodFraction = 0.0f;
+		}
 	}
 
-	if (!outFilename)
-		outFilename = "output.dds";
-	
 	inData = jrcDdsLoad(inFilename, &type, &flags, &inWidth, &inHeight, &inNumMips);
 	
 	if (!inData)
@@ -745,6 +6684,38 @@ int main(int argc, char *argv[])
 	}
 
 	int inRes = inWidth;
+
+	if (matrixCacheDir && inRes > 16384)
+	{
+		printf("The convolution matrix is limited to 16384 texels per side, not using it.\n");
+		matrixCacheDir = NULL;
+	}
+
+	// the rest of a batch, as level 0 data
+	uint8_t *batchData[BATCH_MAX];
+	int i;
+
+	for (i = 1; i < numInputs; i++)
+	{
+		int width, height, numMips;
+		uint8_t *data = jrcDdsLoad(inFilenames[i], &type, &flags, &width, &height, &numMips);
+
+		if (!data)
+		{
+			printf("Error loading %s!\n", inFilenames[i]);
+			return 0;
+		}
+
+		if (type != DDSTYPE_RGBA || width != inRes || height != inRes)
+		{
+			printf("Error! %s must be an RGBA32 cubemap the same size as %s!\n", inFilenames[i], inFilename);
+			return 0;
+		}
+
+		batchData[i] = extractInputLevel(data, inRes, numMips, 0);
+		free(data);
+	}
+
 	int inNumPixels = inWidth * inHeight * 6;
 
 	int outRes = inRes;
@@ -759,8 +6730,14 @@ int main(int argc, char *argv[])
 		mipRes >>= 1;
 	}
 	outNumPixels = outNumFacePixels * 6;
+
+	if (matrixCacheDir && estimateMatrixEntries(inRes, numMips, simSamples) > UINT32_MAX)
+	{
+		printf("The convolution matrix would have more than %u weights, not using it.\n", UINT32_MAX);
+		matrixCacheDir = NULL;
+	}
 	
-	void *sched_memory;
+	void *sched_memory = NULL;
 	struct scheduler sched;
 
 	if (numThreads != 1)
@@ -771,39 +6748,179 @@ int main(int argc, char *argv[])
 		scheduler_start(&sched, sched_memory);
 	}
 	
-	printf("Reading %d pixels (%dx%dx6, 1 mip) from %s\n", inNumPixels, inWidth, inHeight, inFilename);
-	printf("Writing %d pixels (%dx%dx6, %d mips) to %s\n", outNumPixels, outRes, outRes, numMips, outFilename);
+	for (i = 0; i < numInputs; i++)
+		printf("Reading %d pixels (%dx%dx6, 1 mip) from %s\n", inNumPixels, inWidth, inHeight, inFilenames[i]);
+	for (i = 0; i < numInputs; i++)
+		printf("Writing %d pixels (%dx%dx6, %d mips) to %s\n", outNumPixels, outRes, outRes, numMips, i ? outFilenames[i] : outFilename);
 	printf("Working...\n");
 	
 	int64_t startTime = jrcGetTime();
-	unsigned char *outData = malloc(outNumPixels * 4);
-	float *inDataFP32 = formatDataForConvolution(inData, inRes);
 
-	if (numThreads != 1)
+	// threads only look up geometry tables
+	for (mipRes = outRes; mipRes; mipRes >>= 1)
+		getGeometryTable(mipRes);
+
+	unsigned char *outData = malloc((size_t)outNumPixels * 4 * numInputs);
+	float *inDataFP32 = NULL;
+
+	if (lobeEnergyCutoff)
+		buildLobeCutoffs(numMips);
+
+	buildMipPlans(outRes, numMips, simSamples);
+
+	if (shOrder)
+		buildSHProjection(inData, inRes, inNumMips, numMips, simSamples);
+
+	if (importanceSamples)
+	{
+		int mipNum;
+
+		buildSampleLevels(inData, inRes, inNumMips);
+		for (mipNum = 0; mipNum < numMips; mipNum++)
+			buildSampleSet(&sampleSets[mipNum], calcRoughness(mipNum, numMips), importanceSamples, inRes);
+	}
+	else if (matrixCacheDir)
+	{
+		uint8_t *inLevelData = extractInputLevel(inData, inRes, inNumMips, 0);
+		prepareConvolutionMatrix(inLevelData, inRes, numMips, outNumPixels, simSamples);
+		free(inLevelData);
+	}
+	else if (numInputs > 1)
+	{
+		batchData[0] = extractInputLevel(inData, inRes, inNumMips, 0);
+		inDataFP32 = formatDataForBatch(batchData, numInputs, inRes);
+
+		for (i = 0; i < numInputs; i++)
+			free(batchData[i]);
+	}
+	else if (!previewMode)
+	{
+		uint8_t *inLevelData = extractInputLevel(inData, inRes, inNumMips, 0);
+		inDataFP32 = formatDataForConvolution(inLevelData, inRes);
+		free(inLevelData);
+
+		if (sourceLodFraction)
+		{
+			buildSourceLevels(inData, inRes, inNumMips, inDataFP32);
+			selectPlanSourceLevels();
+		}
+
+		if (smallLobeRadius && conicCulling && !tileEpsilon)
+		{
+			if (formatDataForConvolution == formatDataForConvolutionPlanar)
+				selectSmallLobeMips(numMips, inDataFP32, inWidth, inHeight, simSamples);
+			else
+				printf("The small lobe fast path needs FP32 planar input data, not using it.\n");
+		}
+	}
+
+	if (tileEpsilon)
+		buildTileHierarchy(inDataFP32, inWidth, inHeight);
+
+	if (sparseStep && !previewMode)
+	{
+		selectSparseMips(outRes, numMips);
+		sparseGridPass = 1;
+	}
+
+	struct convolveInfo info;
+	info.outData = outData;
+	info.outRes = outRes;
+	info.outNumMips = numMips;
+	info.inDataFP32 = inDataFP32;
+	info.inWidth = inWidth;
+	info.inHeight = inHeight;
+	info.simSamples = simSamples;
+	info.blockSize = blockSize;
+	info.tileSize = scheduleTileSize;
+	info.numConvolved = NULL;
+	info.numMaps = numInputs;
+	info.outNumPixels = outNumPixels;
+
+	if (previewMode)
+	{
+		convolveCubemapPreview(outData, outRes, numMips, inData, inRes, inNumMips);
+	}
+	else if (matrixCacheDir && numThreads != 1)
+	{
+		struct sched_task task;
+
+		scheduler_add(&task, &sched, convolveCubemapToPixelMatrixThreaded, &info, outNumPixels);
+		scheduler_join(&sched, &task);
+	}
+	else if (matrixCacheDir)
+	{
+		convolveCubemapToPixelMatrixRange(outData, 0, outNumPixels);
+	}
+	else if (numInputs > 1 && numThreads != 1)
+	{
+		struct sched_task task;
+
+		scheduler_add(&task, &sched, convolveCubemapToPixelBatchThreaded, &info, outNumPixels);
+		scheduler_join(&sched, &task);
+	}
+	else if (numInputs > 1)
+	{
+		convolveCubemapToPixelBatchRange(outData, outRes, numMips, outNumPixels, 0, outNumPixels, inDataFP32, numInputs, inWidth, inHeight, simSamples);
+	}
+	else if (numThreads != 1)
 	{
 		struct sched_task task;
-		struct convolveInfo info;
-		info.outData = outData;
-		info.outRes = outRes;
-		info.outNumMips = numMips;
-		info.inDataFP32 = inDataFP32;
-		info.inWidth = inWidth;
-		info.inHeight = inHeight;
-		info.simSamples = simSamples;
-
-		scheduler_add(&task, &sched, convolveCubemapToPixelThreaded, &info, outNumPixels);
+
+		if (scheduleTileSize)
+			scheduler_add(&task, &sched, convolveCubemapToTileThreaded, &info, countOutputTiles(outRes, scheduleTileSize));
+		else
+		{
+			buildWorkItems(outRes, numMips, inWidth, sched.partitions_num);
+			scheduler_add(&task, &sched, convolveWorkItemThreaded, &info, numWorkPartitions);
+		}
 		scheduler_join(&sched, &task);
 	}
+	else if (scheduleTileSize)
+	{
+		convolveCubemapToTileRange(outData, outRes, numMips, 0, countOutputTiles(outRes, scheduleTileSize), scheduleTileSize, blockSize, inDataFP32, inWidth, inHeight, simSamples);
+	}
 	else
 	{
-		int i;
-		for (i = 0; i < outNumPixels; i++)
-			convolveCubemapToPixel(outData, outRes, numMips, i, inDataFP32, inWidth, inHeight, simSamples);
+		buildWorkItems(outRes, numMips, inWidth, 1);
+		convolveWorkItemRange(outData, numMips, 0, numWorkItems, blockSize, inDataFP32, inWidth, inHeight, simSamples);
 	}
 	
+	if (numSlicedPixels)
+		reduceSlicedPixels(outData);
+
+	if (sparseGridPass)
+	{
+		int numCells = countSparseCells(outRes, numMips);
+		info.numConvolved = calloc(numCells + 1, sizeof(int));
+		sparseGridPass = 0;
+
+		if (numThreads != 1 && numCells)
+		{
+			struct sched_task task;
+
+			scheduler_add(&task, &sched, fillSparseCellThreaded, &info, numCells);
+			scheduler_join(&sched, &task);
+		}
+		else
+		{
+			fillSparseCellRange(outData, outRes, numMips, 0, numCells, info.numConvolved, inDataFP32, inWidth, inHeight, simSamples);
+		}
+
+		reportSparseCoverage(outRes, numMips, info.numConvolved);
+		free(info.numConvolved);
+	}
+
+	for (i = 0; i < numInputs; i++)
+	{
+		if (isDerivedMip(numMips - 1, numMips))
+			deriveRoughMips(outData + (size_t)i * outNumPixels * 4, outRes, numMips);
+	}
+
 	printf("Saving...\n");
 	
-	jrcDdsSave(outFilename, DDSTYPE_RGBA, DDSFLAG_CUBEMAP, outRes, outRes, numMips, outData);
+	for (i = 0; i < numInputs; i++)
+		jrcDdsSave(i ? outFilenames[i] : outFilename, DDSTYPE_RGBA, DDSFLAG_CUBEMAP, outRes, outRes, numMips, outData + (size_t)i * outNumPixels * 4);
 
 	int64_t endTime = jrcGetTime();
 	printf("\n%.3f seconds elapsed.\n", (endTime - startTime) / 1000.0f);